@@ -9,24 +9,50 @@
 
 #include <iostream>
 #include <string>
+#include <deque>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <sstream>
+#include <atomic>
+#include <chrono>
 #include <boost/algorithm/string.hpp>
 #include <boost/thread/future.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/thread.hpp>
+#include <boost/version.hpp>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <zlib.h>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 
 #ifdef JRB_NODE_SSL
 #include <boost/asio/ssl.hpp>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #endif
 
 
 namespace jrb_node{
 
-	struct jrb_parser_message:public http_parser{
-		http_message message_;
-		std::string current_header_;
-		std::string last_header_;
-	};
-
 	namespace{
 		void jrb_shutdown_helper(boost::asio::ip::tcp::socket& s, boost::system::error_code& ec){
 			s.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
@@ -42,6 +68,18 @@ namespace jrb_node{
 		}
 #endif
 
+		void jrb_keep_session_helper(boost::asio::ip::tcp::socket&){}
+#ifdef JRB_NODE_SSL
+		// OpenSSL drops the session of a connection freed without close_notify from the cache,
+		// which is how most clients end a connection. Keep it if the handshake went through
+		void jrb_keep_session_helper(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& s){
+			SSL* ssl = s.native_handle();
+			if(SSL_is_init_finished(ssl)){
+				SSL_set_shutdown(ssl,SSL_get_shutdown(ssl) | SSL_SENT_SHUTDOWN);
+			}
+		}
+#endif
+
 #define XX(num, name, string) #string,
 
 const std::string method_names[] = 	{	// HTTP Method names
@@ -50,14 +88,158 @@ const std::string method_names[] = 	{	// HTTP Method names
 #undef XX
 	}
 
+	typedef std::array<char,8192> jrb_read_buffer;
+
+	// A parsed message. The url, headers and body refer directly into the read
+	// buffers the message arrived in; only a token split across two reads is copied
+	struct jrb_parser_message:public http_parser{
+		enum callback_type{cb_none,cb_url,cb_field,cb_value,cb_body};
+
+		string_ref url_;
+		string_ref body_;
+		request::header_refs_type headers_;
+		int last_callback_;
+
+		// the read buffers referenced by url_, headers_ and body_
+		std::vector<std::shared_ptr<jrb_read_buffer>> buffers_;
+		// joined copies of tokens that were split across reads
+		std::deque<std::string> spill_;
+
+		// built on first use by the std::string based accessors of request
+		mutable std::unique_ptr<http_message> message_;
+
+		// built on first use by request::query_params. Decoded names and values live in query_spill_
+		mutable bool query_parsed_;
+		mutable request::query_refs_type query_params_;
+		mutable std::deque<std::string> query_spill_;
+
+		jrb_parser_message():last_callback_(cb_none),query_parsed_(false){}
+
+		void clear(){
+			url_ = string_ref();
+			body_ = string_ref();
+			headers_.clear();
+			last_callback_ = cb_none;
+			buffers_.clear();
+			spill_.clear();
+			message_.reset();
+			query_parsed_ = false;
+			query_params_.clear();
+			query_spill_.clear();
+		}
+
+		void hold(const std::shared_ptr<jrb_read_buffer>& b){
+			if(buffers_.empty() || buffers_.back() != b){
+				buffers_.push_back(b);
+			}
+		}
+
+		// Adds the run at,length to r. The parser only continues a token in a later
+		// read, so a continued token is joined in spill_
+		void append(string_ref& r, const char* at, std::size_t length){
+			if(r.empty()){
+				r = string_ref(at,length);
+			}
+			else{
+				if(spill_.empty() || spill_.back().data() != r.data()){
+					spill_.push_back(r.to_string());
+				}
+				spill_.back().append(at,length);
+				r = string_ref(spill_.back());
+			}
+		}
+
+		// body_ as a string of its own, for a body that is rewritten as it arrives
+		std::string& owned_body(){
+			if(spill_.empty() || spill_.back().data() != body_.data()){
+				spill_.push_back(body_.to_string());
+			}
+			return spill_.back();
+		}
+
+		const http_message& message()const{
+			if(!message_){
+				std::unique_ptr<http_message> m(new http_message);
+				m->method(method_names[method]);
+				m->url(url_.to_string());
+				m->body(body_.to_string());
+				for(auto& h:headers_){
+					(*m)[h.first].append(h.second.data(),h.second.size());
+				}
+				message_ = std::move(m);
+			}
+			return *message_;
+		}
+
+		string_ref query()const{
+			http_parser_url u;
+			if(url_.empty() || http_parser_parse_url(url_.data(),url_.size(),method == HTTP_CONNECT,&u)){
+				return string_ref();
+			}
+			if(!(u.field_set & (1 << UF_QUERY))) return string_ref();
+			return string_ref(url_.data() + u.field_data[UF_QUERY].off,u.field_data[UF_QUERY].len);
+		}
+
+		static bool name_less(const std::pair<string_ref,string_ref>& a, const std::pair<string_ref,string_ref>& b){
+			return std::lexicographical_compare(a.first.begin(),a.first.end(),b.first.begin(),b.first.end());
+		}
+
+		const request::query_refs_type& query_params()const{
+			if(!query_parsed_){
+				name_value_parser parser(query());
+				name_value_ref pair;
+				boost::system::error_code ec;
+				std::string buffer;
+				while(parser.next(pair)){
+					string_ref name = pair.decoded_name(buffer,ec);
+					if(ec) continue;
+					if(pair.name_encoded){
+						query_spill_.push_back(std::move(buffer));
+						name = query_spill_.back();
+					}
+					string_ref value = pair.decoded_value(buffer,ec);
+					if(ec) continue;
+					if(pair.value_encoded){
+						query_spill_.push_back(std::move(buffer));
+						value = query_spill_.back();
+					}
+					query_params_.push_back(std::make_pair(name,value));
+				}
+				// stable, so the last of several equal names stays last
+				std::stable_sort(query_params_.begin(),query_params_.end(),name_less);
+				query_parsed_ = true;
+			}
+			return query_params_;
+		}
+	};
+
 	// request methods
 	request::request(): ptr_(){}
 	request::request(std::shared_ptr<jrb_parser_message>p): ptr_(p){}
-	const std::string& request::body() const{return ptr_->message_.body();}
-	const std::string& request::method()const{return ptr_->message_.method();}
-	const std::string& request::url()const{return ptr_->message_.url();}
+	const std::string& request::body() const{return ptr_->message().body();}
+	const std::string& request::method()const{return method_names[ptr_->method];}
+	const std::string& request::url()const{return ptr_->message().url();}
 	int request::status_code()const {return ptr_->status_code;}
-	const http_message::map_type& request::headers()const{return ptr_->message_.headers();}
+	const http_message::map_type& request::headers()const{return ptr_->message().headers();}
+	string_ref request::url_ref()const{return ptr_->url_;}
+	string_ref request::body_ref()const{return ptr_->body_;}
+	const request::header_refs_type& request::header_refs()const{return ptr_->headers_;}
+	string_ref request::query_ref()const{return ptr_->query();}
+	const request::query_refs_type& request::query_params()const{return ptr_->query_params();}
+	string_ref request::query_param(const string_ref& name)const{
+		auto& params = ptr_->query_params();
+		auto iter = std::upper_bound(params.begin(),params.end(),std::make_pair(name,string_ref()),jrb_parser_message::name_less);
+		if(iter == params.begin() || (iter - 1)->first != name) return string_ref();
+		return (iter - 1)->second;
+	}
+	string_ref request::header(const string_ref& name)const{
+		for(auto& h:ptr_->headers_){
+			if(detail::ascii_iequals(h.first,name)){
+				return h.second;
+			}
+		}
+		return string_ref();
+	}
 
 	
 	// helper function
@@ -71,164 +253,1147 @@ const std::string method_names[] = 	{	// HTTP Method names
 
 	}
 
+	// A read only mapping of a whole file
+	struct mapped_file{
+		const char* data_;
+		std::size_t size_;
+#ifdef _WIN32
+		std::string storage_;
+#endif
+
+		mapped_file():data_(nullptr),size_(0){}
+		~mapped_file(){
+#ifndef _WIN32
+			if(data_) ::munmap(const_cast<char*>(data_),size_);
+#endif
+		}
+
+		static std::shared_ptr<mapped_file> open(const std::string& path){
+			std::shared_ptr<mapped_file> m(new mapped_file);
+#ifndef _WIN32
+			int fd = ::open(path.c_str(),O_RDONLY | O_CLOEXEC);
+			if(fd < 0) return nullptr;
+			struct stat st;
+			if(::fstat(fd,&st) != 0){
+				::close(fd);
+				return nullptr;
+			}
+			m->size_ = static_cast<std::size_t>(st.st_size);
+			if(m->size_){
+				void* p = ::mmap(nullptr,m->size_,PROT_READ,MAP_PRIVATE,fd,0);
+				if(p == MAP_FAILED){
+					::close(fd);
+					return nullptr;
+				}
+				m->data_ = static_cast<const char*>(p);
+			}
+			::close(fd);
+#else
+			std::ifstream f(path.c_str(),std::ios::binary);
+			if(!f) return nullptr;
+			m->storage_.assign(std::istreambuf_iterator<char>(f),std::istreambuf_iterator<char>());
+			m->data_ = m->storage_.data();
+			m->size_ = m->storage_.size();
+#endif
+			return m;
+		}
+	};
+
+	// The body of a response sent from a file: length_ bytes either at data_ in a mapping,
+	// or from offset_ in the open file fd_
+	struct file_body{
+		std::shared_ptr<mapped_file> mapping_;
+		const char* data_;
+		int fd_;
+		std::uint64_t offset_;
+		std::uint64_t length_;
+
+		file_body():data_(nullptr),fd_(-1),offset_(0),length_(0){}
+		~file_body(){
+#ifndef _WIN32
+			if(fd_ >= 0) ::close(fd_);
+#endif
+		}
+		// still to be sent from fd_, after the head
+		bool from_fd()const{return fd_ >= 0 && length_;}
+	};
+
+	namespace{
+		// Sends as much of f as the socket takes without blocking, ec is would_block if it
+		// stopped short. Returns false if the file cannot go straight to the stream
+		bool jrb_sendfile_helper(boost::asio::ip::tcp::socket& s, file_body& f, boost::system::error_code& ec){
+#if defined(__linux__)
+			if(!s.native_non_blocking()){
+				s.native_non_blocking(true,ec);
+				if(ec) return true;
+			}
+			while(f.length_){
+				off_t offset = static_cast<off_t>(f.offset_);
+				ssize_t n = ::sendfile(s.native_handle(),f.fd_,&offset,static_cast<std::size_t>((std::min)(f.length_,static_cast<std::uint64_t>(1) << 30)));
+				if(n > 0){
+					f.offset_ += n;
+					f.length_ -= n;
+				}
+				else if(n < 0 && errno == EINTR){
+					continue;
+				}
+				else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+					ec = boost::asio::error::would_block;
+					return true;
+				}
+				else{
+					// 0 means the file got shorter
+					ec = n == 0 ? boost::asio::error::eof : boost::system::error_code(errno,boost::system::system_category());
+					return true;
+				}
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+#ifdef JRB_NODE_SSL
+		bool jrb_sendfile_helper(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>&, file_body&, boost::system::error_code&){
+			return false;
+		}
+#endif
+
+		boost::asio::ip::tcp::socket& jrb_tcp_socket(boost::asio::ip::tcp::socket& s){return s;}
+#ifdef JRB_NODE_SSL
+		boost::asio::ip::tcp::socket& jrb_tcp_socket(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& s){return s.next_layer();}
+#endif
+
+		// Reads length bytes of f at its offset into p
+		bool read_file_body(file_body& f, char* p, std::size_t length, boost::system::error_code& ec){
+#ifndef _WIN32
+			while(length){
+				ssize_t n = ::pread(f.fd_,p,length,static_cast<off_t>(f.offset_));
+				if(n < 0 && errno == EINTR) continue;
+				if(n <= 0){
+					ec = n == 0 ? boost::asio::error::eof : boost::system::error_code(errno,boost::system::system_category());
+					return false;
+				}
+				p += n;
+				length -= n;
+				f.offset_ += n;
+				f.length_ -= n;
+			}
+			return true;
+#else
+			ec = boost::asio::error::operation_not_supported;
+			return false;
+#endif
+		}
+	}
+
+	// Inflates a gzip or deflate encoded body as it arrives
+	struct body_decoder{
+		z_stream stream_;
+		bool deflate_;
+		// deflate sent without its zlib header, as some servers do
+		bool raw_;
+		bool done_;
+		std::size_t in_;
+		// decoded bytes so far and the most there may be
+		std::size_t out_;
+		std::size_t max_out_;
+		bool too_large_;
+
+		body_decoder(bool deflate, std::size_t max_out):deflate_(deflate),raw_(false),done_(false),in_(0),out_(0),max_out_(max_out),too_large_(false){
+			std::memset(&stream_,0,sizeof(stream_));
+			// 32 takes either a gzip or a zlib header
+			inflateInit2(&stream_,15 + 32);
+		}
+		~body_decoder(){
+			inflateEnd(&stream_);
+		}
+
+		// Appends what n bytes of data decode to onto out, false if they are not valid or
+		// decode to more than max_out_ bytes in all
+		bool decode(const char* data, std::size_t n, std::string& out){
+			if(done_) return true;
+			std::size_t start = out.size();
+			stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+			stream_.avail_in = static_cast<uInt>(n);
+			while(stream_.avail_in){
+				if(out_ + (out.size() - start) > max_out_){
+					too_large_ = true;
+					return false;
+				}
+				// room for one byte past the limit, which is how going over it shows
+				std::size_t room = (std::min)((std::max)(n * 4,static_cast<std::size_t>(4096)),max_out_ - out_ - (out.size() - start) + 1);
+				std::size_t used = out.size();
+				out.resize(used + room);
+				stream_.next_out = reinterpret_cast<Bytef*>(&out[used]);
+				stream_.avail_out = static_cast<uInt>(room);
+				int ret = inflate(&stream_,Z_NO_FLUSH);
+				out.resize(out.size() - stream_.avail_out);
+				if(ret == Z_DATA_ERROR && deflate_ && !raw_ && in_ == 0){
+					inflateEnd(&stream_);
+					std::memset(&stream_,0,sizeof(stream_));
+					inflateInit2(&stream_,-15);
+					raw_ = true;
+					out.resize(start);
+					stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+					stream_.avail_in = static_cast<uInt>(n);
+					continue;
+				}
+				if(ret == Z_STREAM_END){
+					done_ = true;
+					break;
+				}
+				if(ret != Z_OK && ret != Z_BUF_ERROR) return false;
+			}
+			in_ += n;
+			out_ += out.size() - start;
+			if(out_ > max_out_){
+				too_large_ = true;
+				return false;
+			}
+			return true;
+		}
+
+		// false if the body ended before the encoded data did
+		bool complete()const{return done_ || in_ == 0;}
+	};
+
+	namespace{
+		bool gzip_encode(const std::string& in, std::string& out){
+			z_stream s;
+			std::memset(&s,0,sizeof(s));
+			if(deflateInit2(&s,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15 + 16,8,Z_DEFAULT_STRATEGY) != Z_OK) return false;
+			out.resize(deflateBound(&s,static_cast<uLong>(in.size())));
+			s.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+			s.avail_in = static_cast<uInt>(in.size());
+			s.next_out = reinterpret_cast<Bytef*>(&out[0]);
+			s.avail_out = static_cast<uInt>(out.size());
+			int ret = deflate(&s,Z_FINISH);
+			out.resize(out.size() - s.avail_out);
+			deflateEnd(&s);
+			return ret == Z_STREAM_END;
+		}
+	}
+
+	// Deadlines for the connections of an io_service, kept in a hashed timing wheel: a deadline
+	// goes in the slot of the tick it expires on, so setting or clearing one is O(1) however many
+	// connections there are, and a single timer steps through the slots while any are set
+	class timing_wheel_service:public boost::asio::io_service::service{
+	public:
+		typedef std::function<void(std::uint64_t)> expire_func;
+
+		// Lives in the object it times, which must clear it before it goes away
+		struct entry{
+			entry():prev_(nullptr),next_(nullptr),tick_(0),generation_(0),linked_(false){}
+			entry* prev_;
+			entry* next_;
+			std::uint64_t tick_;
+			// counts the times the entry was set or cleared, so an expiry can be matched to its deadline
+			std::uint64_t generation_;
+			bool linked_;
+			// called from the timer with the generation that expired
+			expire_func expire_;
+		};
+
+		enum{tick_milliseconds = 100, slot_count = 1024};
+
+		static boost::asio::io_service::id id;
+
+		explicit timing_wheel_service(boost::asio::io_service& io):boost::asio::io_service::service(io),timer_(io),
+			slots_(slot_count,nullptr),count_(0),current_(0),running_(false),start_(std::chrono::steady_clock::now()){}
+
+		void shutdown_service(){
+			boost::mutex::scoped_lock lock(mutex_);
+			for(auto& head:slots_){
+				while(head) unlink(*head);
+			}
+			boost::system::error_code ec;
+			timer_.cancel(ec);
+		}
+		void shutdown(){shutdown_service();}
+
+		// Sets e to expire in milliseconds, replacing any deadline it had. Returns the generation
+		std::uint64_t set(entry& e, long milliseconds){
+			boost::mutex::scoped_lock lock(mutex_);
+			if(e.linked_) unlink(e);
+			std::uint64_t tick = now_tick() + (milliseconds + tick_milliseconds - 1) / tick_milliseconds;
+			e.tick_ = tick > current_ ? tick : current_ + 1;
+			link(e);
+			if(!running_) arm();
+			return ++e.generation_;
+		}
+
+		void clear(entry& e){
+			boost::mutex::scoped_lock lock(mutex_);
+			if(e.linked_) unlink(e);
+			++e.generation_;
+		}
+
+	private:
+		void link(entry& e){
+			entry*& head = slots_[e.tick_ % slot_count];
+			e.prev_ = nullptr;
+			e.next_ = head;
+			if(head) head->prev_ = &e;
+			head = &e;
+			e.linked_ = true;
+			++count_;
+		}
+
+		void unlink(entry& e){
+			if(e.prev_) e.prev_->next_ = e.next_;
+			else slots_[e.tick_ % slot_count] = e.next_;
+			if(e.next_) e.next_->prev_ = e.prev_;
+			e.prev_ = e.next_ = nullptr;
+			e.linked_ = false;
+			--count_;
+		}
+
+		std::uint64_t now_tick()const{
+			return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_).count() / tick_milliseconds;
+		}
+
+		void arm(){
+			running_ = true;
+			timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(tick_milliseconds)));
+			timer_.async_wait([this](const boost::system::error_code& ec){
+				if(!ec) tick();
+			});
+		}
+
+		// Expires the entries of the slots passed since the last tick. Entries in those slots
+		// that are a turn of the wheel or more away stay
+		void tick(){
+			std::vector<std::pair<expire_func,std::uint64_t>> expired;
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				std::uint64_t now = now_tick();
+				std::uint64_t first = now - current_ > slot_count ? now - slot_count + 1 : current_ + 1;
+				for(std::uint64_t t = first; t <= now; ++t){
+					entry* e = slots_[t % slot_count];
+					while(e){
+						entry* next = e->next_;
+						if(e->tick_ <= now){
+							expired.push_back(std::make_pair(e->expire_,e->generation_));
+							unlink(*e);
+						}
+						e = next;
+					}
+				}
+				if(now > current_) current_ = now;
+				running_ = false;
+				if(count_) arm();
+			}
+			for(auto& e:expired){
+				e.first(e.second);
+			}
+		}
+
+		boost::asio::deadline_timer timer_;
+		boost::mutex mutex_;
+		std::vector<entry*> slots_;
+		std::size_t count_;
+		// the last tick expired
+		std::uint64_t current_;
+		bool running_;
+		std::chrono::steady_clock::time_point start_;
+	};
+
+	boost::asio::io_service::id timing_wheel_service::id;
+
+	// The connection count of a server, shared with its connections so each one gives its
+	// place back as it goes, and the accept waiting for a place when the server is full.
+	// The limits can be changed while connections come and go
+	struct connection_limit_state:public std::enable_shared_from_this<connection_limit_state>{
+		connection_limit_state():live_(0),shed_(0),max_(0),shed_503_(false),paused_(false),io_(nullptr){}
+		std::atomic<std::size_t> live_;
+		std::atomic<std::uint64_t> shed_;
+		std::atomic<std::size_t> max_;
+		std::atomic<bool> shed_503_;
+		boost::mutex mutex_;
+		bool paused_;
+		boost::asio::io_service* io_;
+		// the paused accept, cleared by stop() as the server goes
+		std::function<void()> resume_;
+
+		bool full()const{
+			std::size_t max = max_;
+			return max && live_ >= max;
+		}
+
+		// Holds back the next accept until there is room, false if there is room already
+		bool pause(boost::asio::io_service& io, std::function<void()> resume){
+			boost::mutex::scoped_lock lock(mutex_);
+			if(shed_503_ || !full()) return false;
+			paused_ = true;
+			io_ = &io;
+			resume_ = resume;
+			return true;
+		}
+
+		// Called as a connection goes
+		void release(){
+			--live_;
+			resume_if_room();
+		}
+
+		void resume_if_room(){
+			boost::asio::io_service* io = nullptr;
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				if(!paused_ || full()) return;
+				paused_ = false;
+				io = io_;
+			}
+			std::weak_ptr<connection_limit_state> weak = shared_from_this();
+			io->post([weak](){
+				if(auto self = weak.lock()) self->resume();
+			});
+		}
+
+		// Runs the paused accept, unless the server stopped meanwhile
+		void resume(){
+			std::function<void()> f;
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				f.swap(resume_);
+			}
+			if(f) f();
+		}
+
+		void stop(){
+			boost::mutex::scoped_lock lock(mutex_);
+			paused_ = false;
+			resume_ = nullptr;
+		}
+	};
+
+	struct body_stream_state{
+		body_stream::chunk_func chunk_func_;
+		// continues parsing on the connection, set by the connection
+		std::function<void()> resume_;
+	};
+
+	void body_stream::on_chunk(chunk_func f){state_->chunk_func_ = f;}
+	void body_stream::resume(){
+		if(state_->resume_) state_->resume_();
+	}
+
 	template <class  AsyncReadStream>
-	struct jrb_stream_reader :public jrb_parser_message,public std::enable_shared_from_this<jrb_stream_reader<AsyncReadStream>>{
+	struct jrb_stream_reader :public http_parser,public std::enable_shared_from_this<jrb_stream_reader<AsyncReadStream>>{
 		typedef std::function<bool (request&, response&, const boost::system::error_code& )> handler_func;
 		handler_func handler_;
+		// when set, requests are handed over once their headers are in and the body is streamed
+		typedef std::function<bool (request&, response&, body_stream&)> stream_handler_func;
+		stream_handler_func stream_handler_;
+		// the body being streamed, and whether parsing waits for its chunk to be consumed
+		std::shared_ptr<body_stream_state> body_;
+		bool body_paused_;
 		typedef std::shared_ptr<AsyncReadStream> s_type;
 		s_type s_;
+		// every completion handler of the connection runs through the strand, so the io_service
+		// may be run from several threads
+		boost::asio::io_service::strand strand_;
 		http_parser_settings settings;
-		std::array<char,8192> buffer_;
+		// parsed messages refer into the read buffer, so a new one is only allocated
+		// when a message still in use holds on to the current one
+		std::shared_ptr<jrb_read_buffer> buffer_;
+		// (*buffer_)[buffer_offset_,buffer_end_) holds bytes not yet given to the parser
+		std::size_t buffer_offset_;
+		std::size_t buffer_end_;
 		int total_bytes_;
 		bool finished_;
+		bool keep_alive_;
+		bool eof_;
+		bool read_closed_;
+		bool writing_;
+		// client connections read a single response and then leave the socket to the connection pool
+		bool single_message_;
+		// decodes gzip and deflate bodies, which then arrive without Content-Encoding and Content-Length
+		bool decode_body_;
+		std::size_t max_decoded_body_;
+		std::unique_ptr<body_decoder> decoder_;
+
+		// the phase the connection is in, which decides its deadline
+		enum deadline_phase{phase_none,phase_handshake,phase_header,phase_body,phase_handler,phase_write,phase_idle};
+		connection_timeouts timeouts_;
+		int phase_;
+		timing_wheel_service* wheel_;
+		timing_wheel_service::entry deadline_;
+		bool headers_done_;
+		// a deadline shut the connection, reported as timed_out
+		bool timed_out_;
+		// of the server that accepted the connection
+		std::shared_ptr<connection_limit_state> limit_;
+		// a handshake on a tls_handshake_pool runs on this strand of the pool, where a deadline
+		// has to shut the socket down as well. handshake_running_ is only touched on it
+		std::shared_ptr<boost::asio::io_service::strand> handshake_strand_;
+		bool handshake_running_;
+		boost::system::error_code eof_error_;
+
+		// stop parsing pipelined requests while this many responses are outstanding
+		static const std::size_t max_pipelined = 16;
+
+		// the message being parsed
+		std::shared_ptr<jrb_parser_message> current_;
+		// messages completed by the current http_parser_execute, dispatched in order afterwards
+		std::vector<std::shared_ptr<jrb_parser_message>> completed_;
+		// dispatched messages, reused for later messages once their request is gone
+		std::vector<std::shared_ptr<jrb_parser_message>> spare_;
+		static const std::size_t max_spare = 4;
+
+		// responses in request order, ready is set once the handler has sent the response.
+		// They are written as the static status line, the rendered headers and the body.
+		// A chunked response stays at the front, holding back the ones after it, until its
+		// last chunk is queued
+		struct pending_response{
+			bool ready;
+			bool keep_alive;
+			bool head_written;
+			bool complete;
+			boost::asio::const_buffer status;
+			std::string head;
+			std::string body;
+			std::shared_ptr<file_body> file;
+			// framed chunks not written yet, with the functions to call once they are
+			std::deque<std::string> chunks;
+			std::vector<response::write_func> chunks_written;
+		};
+		std::deque<pending_response> responses_;
+		// sequence number of responses_.front()
+		std::size_t first_response_;
+		// the error a write failed with, given to chunks queued afterwards
+		boost::system::error_code write_error_;
+
 		typename AsyncReadStream::lowest_layer_type& socket(){return s_->lowest_layer();}
 
 
 
 		void start(){		  
+			release_spare_buffers();
+			if(buffer_.use_count() > 1){
+				buffer_ = std::make_shared<jrb_read_buffer>();
+			}
 			auto ptr = this->shared_from_this();
-			s_->async_read_some(boost::asio::buffer(buffer_),[ptr]( const boost::system::error_code& error,  std::size_t bytes_transferred )->void{
+			s_->async_read_some(boost::asio::buffer(*buffer_),strand_.wrap([ptr]( const boost::system::error_code& error,  std::size_t bytes_transferred )->void{
 				ptr->handle_read(error,bytes_transferred);
-			});
+			}));
+			update_deadline();
+		}
+
+		// Moves the connection to phase, with a new deadline unless it is already there.
+		// body_read and write limit each wait, so they start over every time
+		void deadline(int phase){
+			if(phase == phase_ && phase != phase_body && phase != phase_write) return;
+			phase_ = phase;
+			long ms = 0;
+			switch(phase){
+			case phase_handshake: ms = timeouts_.handshake; break;
+			case phase_header: ms = timeouts_.header_read; break;
+			case phase_body: ms = timeouts_.body_read; break;
+			case phase_handler: ms = timeouts_.handler; break;
+			case phase_write: ms = timeouts_.write; break;
+			case phase_idle: ms = timeouts_.keep_alive_idle; break;
+			}
+			if(ms <= 0){
+				if(wheel_) wheel_->clear(deadline_);
+				return;
+			}
+			if(!wheel_){
+				wheel_ = &boost::asio::use_service<timing_wheel_service>(s_->get_io_service());
+				std::weak_ptr<jrb_stream_reader> weak = this->shared_from_this();
+				deadline_.expire_ = [weak](std::uint64_t generation){
+					if(auto ptr = weak.lock()){
+						ptr->strand_.post([ptr,generation](){ptr->deadline_expired(generation);});
+					}
+				};
+			}
+			wheel_->set(deadline_,ms);
 		}
-		jrb_stream_reader(s_type s,handler_func f):s_(s),handler_(f),total_bytes_(0),finished_(false){init();}
-		jrb_stream_reader(boost::asio::io_service& io, handler_func f):s_(new AsyncReadStream(io)),handler_(f),total_bytes_(0),finished_(false){
+
+		// The phase follows from what the connection is waiting for
+		void update_deadline(){
+			if(single_message_ && finished_) deadline(phase_none);
+			else if(writing_) deadline(phase_write);
+			else if(body_paused_ || !responses_.empty()) deadline(phase_handler);
+			else if(current_) deadline(headers_done_ ? phase_body : phase_header);
+			else if(single_message_ || total_bytes_ == 0) deadline(phase_header);
+			else deadline(phase_idle);
+		}
+
+		// Shuts the socket down, which ends whatever is waiting on it. A handshake on a pool is
+		// shut down from the pool's strand, unless it has finished by then
+		void deadline_expired(std::uint64_t generation){
+			if(generation != deadline_.generation_) return;
+			if(phase_ != phase_idle) timed_out_ = true;
+			if(phase_ == phase_handshake && handshake_strand_){
+				auto ptr = this->shared_from_this();
+				handshake_strand_->post([ptr](){
+					if(!ptr->handshake_running_) return;
+					boost::system::error_code ec;
+					ptr->socket().shutdown(boost::asio::ip::tcp::socket::shutdown_both,ec);
+				});
+				return;
+			}
+			boost::system::error_code ec;
+			socket().shutdown(boost::asio::ip::tcp::socket::shutdown_both,ec);
+		}
+
+		boost::system::error_code io_error(const boost::system::error_code& e)const{
+			return timed_out_ && e ? boost::system::error_code(boost::asio::error::timed_out) : e;
+		}
+		jrb_stream_reader(s_type s,handler_func f):handler_(f),s_(s),strand_(s_->get_io_service()){init();}
+		jrb_stream_reader(boost::asio::io_service& io, handler_func f):handler_(f),s_(new AsyncReadStream(io)),strand_(io){
 			init();
 		}
 
 		template<class T, class U>
-		jrb_stream_reader(T&& t, U&& u, handler_func f):s_(new AsyncReadStream(std::forward<T>(t),std::forward<U>(u))),handler_(f),total_bytes_(0),finished_(false){
+		jrb_stream_reader(T&& t, U&& u, handler_func f):handler_(f),s_(new AsyncReadStream(std::forward<T>(t),std::forward<U>(u))),strand_(s_->get_io_service()){
 			init();
 		}
 
 
 		void init(){
 			++counter;
+			buffer_ = std::make_shared<jrb_read_buffer>();
+			buffer_offset_ = 0;
+			buffer_end_ = 0;
+			total_bytes_ = 0;
+			finished_ = false;
+			keep_alive_ = false;
+			eof_ = false;
+			read_closed_ = false;
+			writing_ = false;
+			single_message_ = false;
+			decode_body_ = false;
+			max_decoded_body_ = 0;
+			timeouts_ = connection_timeouts::none();
+			phase_ = phase_none;
+			wheel_ = nullptr;
+			headers_done_ = false;
+			timed_out_ = false;
+			handshake_running_ = false;
+			body_paused_ = false;
+			first_response_ = 0;
 			settings = http_parser_settings();
 			http_parser_init(this, HTTP_BOTH);
-			settings.on_message_complete = [](http_parser* p){
+			settings.on_message_begin = [](http_parser* p)->int{
+				jrb_stream_reader<AsyncReadStream>* pm = static_cast<jrb_stream_reader<AsyncReadStream>*>(p);
+				pm->finished_ = false;
+				pm->headers_done_ = false;
+				pm->current_ = pm->acquire_message();
+				return 0;
+			};
+			settings.on_message_complete = [](http_parser* p)->int{
 				jrb_stream_reader<AsyncReadStream>* pm = static_cast<jrb_stream_reader<AsyncReadStream>*>(p);
+				if(pm->decoder_){
+					bool complete = pm->decoder_->complete();
+					pm->decoder_.reset();
+					if(!complete) return 1;
+				}
 				pm->finished_ = true;
-				pm->message_.method(method_names[pm->method]);
-				if(pm->total_bytes_){
-					request req(pm->shared_from_this());
-					response_derived res;
-					boost::system::error_code ec;
-					auto ptr = pm->shared_from_this();
-					auto sender_func = [ptr](response& res){
-												auto str = std::make_shared<std::string>(res.get_as_http());
-						boost::asio::async_write( *(ptr->s_),boost::asio::buffer(*str),[ptr,str](const boost::system::error_code& e,  std::size_t bytes_transferred ){ 
-							if(e){
-								request req;
-								response res;
-								ptr->handler_(req,res,e);
-								boost::system::error_code ec;
-								jrb_shutdown_helper(*ptr->s_,ec);
-
-							}else{
-								boost::system::error_code ec;
-								jrb_shutdown_helper(*ptr->s_,ec);
-							}
-						});
+				pm->keep_alive_ = http_should_keep_alive(p) != 0;
 
-					};
-					res.set_sender_func(sender_func);
-					if(pm->handler_(req,res,ec)){
-						res.send();
-					}
+				if(pm->body_){
+					pm->end_body(boost::system::error_code());
 				}
+				else{
+					static_cast<http_parser&>(*pm->current_) = *p;
+					pm->completed_.push_back(pm->current_);
+				}
+				pm->current_.reset();
 
-
+				// Nothing more is read after a message that closes the connection, and
+				// parsing waits for the responses to drain if too many are outstanding
+				if(!pm->keep_alive_ || pm->single_message_ || pm->responses_.size() + pm->completed_.size() >= max_pipelined){
+					http_parser_pause(p,1);
+				}
 				return 0;
 
 			};
 
 
 			settings.on_url = [](http_parser* p, const char *at, size_t length)->int{
-				jrb_parser_message* pm = static_cast<jrb_parser_message*>(p);
-				pm->message_.url(pm->message_.url() + std::string(at,length));
+				jrb_parser_message* pm = static_cast<jrb_stream_reader<AsyncReadStream>*>(p)->token_message();
+				pm->append(pm->url_,at,length);
+				pm->last_callback_ = jrb_parser_message::cb_url;
 				return 0;
 			};
 			settings.on_header_value = [](http_parser *p, const char *at, size_t length)->int{
-				jrb_parser_message* pm = static_cast<jrb_parser_message*>(p);
-				if(pm->current_header_.size()){
-					pm->last_header_ = std::move(pm->current_header_);
-					pm->current_header_.clear();
+				jrb_parser_message* pm = static_cast<jrb_stream_reader<AsyncReadStream>*>(p)->token_message();
+				if(pm->headers_.empty()) return 0;
+				if(pm->last_callback_ == jrb_parser_message::cb_value){
+					pm->append(pm->headers_.back().second,at,length);
 				}
-				pm->message_[pm->last_header_] += std::string(at,length);
+				else{
+					pm->headers_.back().second = string_ref(at,length);
+				}
+				pm->last_callback_ = jrb_parser_message::cb_value;
 				return 0;
 
 			};
 			settings.on_header_field = [](http_parser *p, const char *at, size_t length)->int{
-				jrb_parser_message* pm = static_cast<jrb_parser_message*>(p);
-				pm->current_header_ += std::string(at,length);
+				jrb_parser_message* pm = static_cast<jrb_stream_reader<AsyncReadStream>*>(p)->token_message();
+				if(pm->last_callback_ == jrb_parser_message::cb_field){
+					pm->append(pm->headers_.back().first,at,length);
+				}
+				else{
+					pm->headers_.push_back(std::make_pair(string_ref(at,length),string_ref()));
+				}
+				pm->last_callback_ = jrb_parser_message::cb_field;
+				return 0;
+			};
+			settings.on_headers_complete = [](http_parser* p)->int{
+				jrb_stream_reader<AsyncReadStream>* pm = static_cast<jrb_stream_reader<AsyncReadStream>*>(p);
+				pm->headers_done_ = true;
+				if(pm->stream_handler_){
+					pm->stream_message();
+				}
+				else if(pm->decode_body_){
+					pm->start_decoder();
+				}
 				return 0;
 			};
 			settings.on_body = [](http_parser *p, const char *at, size_t length)->int{
-				jrb_parser_message* pm = static_cast<jrb_parser_message*>(p);
-				pm->message_.body_append( std::string(at,length));
+				jrb_stream_reader<AsyncReadStream>* r = static_cast<jrb_stream_reader<AsyncReadStream>*>(p);
+				if(r->body_){
+					auto& f = r->body_->chunk_func_;
+					if(f && !f(boost::system::error_code(),string_ref(at,length),false)){
+						r->body_paused_ = true;
+						http_parser_pause(p,1);
+					}
+					return 0;
+				}
+				if(r->decoder_){
+					jrb_parser_message* pm = r->current_.get();
+					std::string& body = pm->owned_body();
+					bool ok = r->decoder_->decode(at,length,body);
+					pm->body_ = string_ref(body);
+					pm->last_callback_ = jrb_parser_message::cb_body;
+					return ok ? 0 : 1;
+				}
+				jrb_parser_message* pm = r->token_message();
+				pm->append(pm->body_,at,length);
+				pm->last_callback_ = jrb_parser_message::cb_body;
 				return 0;
 			};
 
 
 		}
 
-		void handle_read( const boost::system::error_code& error,  std::size_t bytes_transferred ){
-			total_bytes_+= bytes_transferred;
-			if(is_short_read(error) && total_bytes_==0){
-				// close the connection
-				boost::system::error_code ec;
-				jrb_shutdown_helper(*s_,ec);
+		// Sets up decoder_ if the current message has a gzip or deflate body
+		void start_decoder(){
+			decoder_.reset();
+			auto& headers = current_->headers_;
+			auto encoding = std::find_if(headers.begin(),headers.end(),[](const std::pair<string_ref,string_ref>& h){
+				return detail::ascii_iequals(h.first,"Content-Encoding");
+			});
+			if(encoding == headers.end()) return;
+			bool deflate = detail::ascii_iequals(encoding->second,"deflate");
+			if(!deflate && !detail::ascii_iequals(encoding->second,"gzip") && !detail::ascii_iequals(encoding->second,"x-gzip")) return;
+			decoder_.reset(new body_decoder(deflate,max_decoded_body_));
+			headers.erase(std::remove_if(headers.begin(),headers.end(),[](const std::pair<string_ref,string_ref>& h){
+				return detail::ascii_iequals(h.first,"Content-Encoding") || detail::ascii_iequals(h.first,"Content-Length");
+			}),headers.end());
+		}
+
+		// The message a token callback refers to, holding on to the buffer the token is in
+		jrb_parser_message* token_message(){
+			current_->hold(buffer_);
+			return current_.get();
+		}
+
+		std::shared_ptr<jrb_parser_message> acquire_message(){
+			for(auto iter = spare_.begin(); iter != spare_.end(); ++iter){
+				if(iter->use_count() == 1){
+					auto msg = *iter;
+					spare_.erase(iter);
+					msg->clear();
+					return msg;
+				}
 			}
-			else if(error  == boost::asio::error::eof || is_short_read(error) ){ // boost returns short read for ssl termination	
-					if(bytes_transferred){
-						const char* data = buffer_.data();
-						if(http_parser_execute(this,&settings,data,bytes_transferred) != bytes_transferred){
-							// error parsing
-							request req;
-							response res;
-							handler_(req,res,boost::system::errc::make_error_code(boost::system::errc::bad_message));
-						}
+			return std::make_shared<jrb_parser_message>();
+		}
 
-					}
-					if(finished_) return;
-					char a = 0;
-					if(http_parser_execute(this,&settings,&a,0) != 0 || finished_==false){
-							// error parsing or 0 read
-							request req;
-							response res;
-							handler_(req,res,error);
-					}
+		// Lets go of the read buffers held by messages nobody uses any more
+		void release_spare_buffers(){
+			for(auto& msg:spare_){
+				if(msg.use_count() == 1){
+					msg->clear();
+				}
 			}
-			else if(error){
+		}
+
+		bool paused(){return HTTP_PARSER_ERRNO(this) == HPE_PAUSED;}
+
+		// Parses what is left in buffer_, then either reads more, handles the end of the
+		// stream, or waits for responses to be written if the parser is paused
+		void process(){
+			std::size_t len = buffer_end_ - buffer_offset_;
+			// a 0 length tells the parser the stream ended, which is up to handle_eof
+			std::size_t parsed = len ? http_parser_execute(this,&settings,buffer_->data() + buffer_offset_,len) : 0;
+			buffer_offset_ += parsed;
+			dispatch();
+			update_deadline();
+			if(paused()){
+				return;
+			}
+			if(parsed != len || HTTP_PARSER_ERRNO(this) != HPE_OK){
+				// error parsing
+				auto error = decoder_ && decoder_->too_large_ ? boost::system::errc::message_size : boost::system::errc::bad_message;
+				end_body(boost::system::errc::make_error_code(error));
 				request req;
 				response res;
-				handler_(req,res,error);
+				handler_(req,res,boost::system::errc::make_error_code(error));
+				return;
+			}
+			if(eof_){
+				handle_eof();
 			}
 			else{
-				if(bytes_transferred){
-					const char* data = buffer_.data();
-					if(http_parser_execute(this,&settings,data,bytes_transferred) != bytes_transferred){
-							// error parsing
-							request req;
-							response res;
-							handler_(req,res,boost::system::errc::make_error_code(boost::system::errc::bad_message));
-					}
+				start();
+			}
+		}
 
+		void handle_eof(){
+			if(!finished_){
+				char a = 0;
+				std::size_t parsed = http_parser_execute(this,&settings,&a,0);
+				dispatch();
+				if((parsed != 0 && !paused()) || finished_==false){
+					// error parsing or 0 read
+					end_body(eof_error_ ? eof_error_ : boost::asio::error::eof);
+					request req;
+					response res;
+					handler_(req,res,eof_error_);
+					return;
 				}
-				if(finished_) return;
-				auto ptr =this->shared_from_this();
-				s_->async_read_some(boost::asio::buffer(buffer_),[ptr]( const boost::system::error_code& error,  std::size_t bytes_transferred )->void{
-					ptr->handle_read(error,bytes_transferred);
+			}
+			// the other side closed between messages, close once the responses are out
+			read_closed_ = true;
+			if(responses_.empty()){
+				boost::system::error_code ec;
+				jrb_shutdown_helper(*s_,ec);
+			}
+		}
+
+		// Calls the handler for each completed message in the order they were received
+		void dispatch(){
+			std::vector<std::shared_ptr<jrb_parser_message>> completed;
+			completed.swap(completed_);
+			for(auto& msg:completed){
+				handle_message(msg,[this](request& req, response& res)->bool{
+					boost::system::error_code ec;
+					return handler_(req,res,ec);
 				});
+			}
+		}
 
+		// Queues the response to msg and calls f with the request and that response
+		template<class F>
+		void handle_message(const std::shared_ptr<jrb_parser_message>& msg, F f){
+			if(spare_.size() < max_spare){
+				spare_.push_back(msg);
+			}
+			std::size_t seq = first_response_ + responses_.size();
+			responses_.push_back(pending_response());
+			responses_.back().ready = false;
+			responses_.back().keep_alive = false;
+			responses_.back().head_written = false;
+			responses_.back().complete = false;
+
+			request req(msg);
+			response_derived res;
+			res.keep_alive(http_should_keep_alive(msg.get()) != 0);
+			res.set_chunk_framing(msg->http_major > 1 || (msg->http_major == 1 && msg->http_minor >= 1));
+			auto ptr = this->shared_from_this();
+			res.set_sender_func([ptr,seq](response& res){
+				ptr->response_ready(seq,res);
+			});
+			res.set_chunk_sender_func([ptr,seq](std::string& chunk, bool last, response::write_func done){
+				ptr->chunk_ready(seq,chunk,last,done);
+			});
+			if(f(req,res)){
+				res.send();
 			}
+		}
 
+		// Hands the current message to stream_handler_ once its headers are in, the body follows
+		// through body_
+		void stream_message(){
+			// messages completed earlier in this read go first
+			dispatch();
+			static_cast<http_parser&>(*current_) = *this;
+			body_ = std::make_shared<body_stream_state>();
+			std::weak_ptr<jrb_stream_reader> weak = this->shared_from_this();
+			body_->resume_ = [weak](){
+				// posted, so a resume from inside the chunk function runs after parsing has paused
+				if(auto ptr = weak.lock()){
+					ptr->strand_.post([ptr](){ptr->resume_body();});
+				}
+			};
+			body_stream stream(body_);
+			handle_message(current_,[this,&stream](request& req, response& res)->bool{
+				return stream_handler_(req,res,stream);
+			});
 		}
-		static int counter;
-		~jrb_stream_reader(){
-			--counter;
-//			std::cout << --counter << "\n";
+
+		void resume_body(){
+			if(!body_paused_) return;
+			body_paused_ = false;
+			http_parser_pause(this,0);
+			process();
+		}
+
+		// Gives the streamed body its last call, ec is set if it did not complete
+		void end_body(const boost::system::error_code& ec){
+			if(!body_) return;
+			auto body = body_;
+			body_.reset();
+			body_paused_ = false;
+			if(body->chunk_func_){
+				body->chunk_func_(ec,string_ref(),true);
+				// the function may hold on to the body_stream
+				body->chunk_func_ = nullptr;
+			}
+		}
+
+		// Called by response::send(), possibly from another thread. The response is
+		// rendered by the caller and then queued on the connection's strand
+		void response_ready(std::size_t seq, response& res){
+			auto ready = std::make_shared<pending_response>();
+			ready->status = res.release_http(ready->head,ready->body,ready->file);
+			ready->keep_alive = res.keep_alive();
+			ready->complete = !res.chunked() && !(ready->file && ready->file->from_fd());
+			auto ptr = this->shared_from_this();
+			strand_.dispatch([ptr,seq,ready](){
+				ptr->queue_response(seq,*ready);
+			});
+		}
+
+		void queue_response(std::size_t seq, pending_response& ready){
+			if(seq < first_response_ || seq - first_response_ >= responses_.size()) return;
+			pending_response& pr = responses_[seq - first_response_];
+			if(pr.ready) return; // already sent
+			pr.status = ready.status;
+			pr.head.swap(ready.head);
+			pr.body.swap(ready.body);
+			pr.file.swap(ready.file);
+			pr.keep_alive = ready.keep_alive;
+			pr.complete = ready.complete;
+			pr.ready = true;
+			flush();
+		}
+
+		// Called by the chunk functions of response, possibly from another thread
+		void chunk_ready(std::size_t seq, std::string& chunk, bool last, response::write_func done){
+			auto data = std::make_shared<std::string>();
+			data->swap(chunk);
+			auto ptr = this->shared_from_this();
+			strand_.dispatch([ptr,seq,data,last,done](){
+				ptr->queue_chunk(seq,*data,last,done);
+			});
+		}
+
+		void queue_chunk(std::size_t seq, std::string& chunk, bool last, response::write_func done){
+			if(write_error_ || seq < first_response_ || seq - first_response_ >= responses_.size()){
+				if(done) done(write_error_ ? write_error_ : boost::asio::error::operation_aborted);
+				return;
+			}
+			pending_response& pr = responses_[seq - first_response_];
+			if(pr.complete) return;
+			if(chunk.size() || done){
+				pr.chunks.push_back(std::string());
+				pr.chunks.back().swap(chunk);
+				pr.chunks_written.push_back(done);
+			}
+			pr.complete = last;
+			flush();
+		}
+
+		// Writes everything that is ready at the front of the queue with a single gather write:
+		// whole responses, and the head and queued chunks of a chunked one
+		void flush(){
+			if(writing_) return;
+			std::vector<boost::asio::const_buffer> buffers;
+			// the chunks being written, and the functions to call once they are
+			auto chunks = std::make_shared<std::deque<std::string>>();
+			auto written = std::make_shared<std::vector<response::write_func>>();
+			// responses finished by this write
+			std::size_t count = 0;
+			bool keep_alive = true;
+			for(auto iter = responses_.begin(); iter != responses_.end() && iter->ready && keep_alive; ++iter){
+				if(!iter->head_written){
+					buffers.push_back(iter->status);
+					buffers.push_back(boost::asio::buffer(iter->head));
+					if(iter->body.size()){
+						buffers.push_back(boost::asio::buffer(iter->body));
+					}
+					if(iter->file && iter->file->data_ && iter->file->length_){
+						buffers.push_back(boost::asio::buffer(iter->file->data_,static_cast<std::size_t>(iter->file->length_)));
+					}
+					iter->head_written = true;
+				}
+				for(auto& c:iter->chunks){
+					chunks->push_back(std::string());
+					chunks->back().swap(c);
+					if(chunks->back().size()){
+						buffers.push_back(boost::asio::buffer(chunks->back()));
+					}
+				}
+				iter->chunks.clear();
+				written->insert(written->end(),iter->chunks_written.begin(),iter->chunks_written.end());
+				iter->chunks_written.clear();
+				if(!iter->complete) break;
+				keep_alive = iter->keep_alive;
+				++count;
+			}
+			if(buffers.empty() && !count && written->empty()){
+				update_deadline();
+				return;
+			}
+			writing_ = true;
+			update_deadline();
+			auto ptr = this->shared_from_this();
+			boost::asio::async_write( *s_,buffers,strand_.wrap([ptr,count,keep_alive,chunks,written](const boost::system::error_code& error, std::size_t){
+				ptr->writing_ = false;
+				boost::system::error_code e = ptr->io_error(error);
+				if(e){
+					ptr->write_error_ = e;
+					for(auto& f:*written){
+						if(f) f(e);
+					}
+					request req;
+					response res;
+					ptr->handler_(req,res,e);
+					boost::system::error_code ec;
+					jrb_shutdown_helper(*ptr->s_,ec);
+					return;
+				}
+				ptr->responses_.erase(ptr->responses_.begin(),ptr->responses_.begin() + count);
+				ptr->first_response_ += count;
+				// the queue is up to date before the functions can queue more chunks
+				for(auto& f:*written){
+					if(f) f(e);
+				}
+				if(!keep_alive || (ptr->read_closed_ && ptr->responses_.empty())){
+					boost::system::error_code ec;
+					jrb_shutdown_helper(*ptr->s_,ec);
+					return;
+				}
+				// the head of a response sent from a file is out, the file follows
+				if(!ptr->responses_.empty() && ptr->responses_.front().head_written && !ptr->responses_.front().complete
+					&& ptr->responses_.front().file && ptr->responses_.front().file->from_fd()){
+					ptr->writing_ = true;
+					ptr->send_file();
+					return;
+				}
+				ptr->flush();
+				// Continue with pipelined requests that were held back
+				if(ptr->paused() && !ptr->body_paused_ && ptr->keep_alive_ && ptr->responses_.size() < max_pipelined){
+					http_parser_pause(ptr.get(),0);
+					ptr->process();
+				}
+			}));
+		}
+
+		// Sends the file of the front response, with sendfile where the stream allows it and
+		// piece by piece otherwise. writing_ is set meanwhile
+		void send_file(){
+			static const std::size_t piece_size = 64 * 1024;
+			update_deadline();
+			auto ptr = this->shared_from_this();
+			file_body& f = *responses_.front().file;
+			boost::system::error_code ec;
+			if(jrb_sendfile_helper(*s_,f,ec)){
+				if(ec == boost::asio::error::would_block){
+					// wait until the socket takes more
+					jrb_tcp_socket(*s_).async_write_some(boost::asio::null_buffers(),strand_.wrap([ptr](const boost::system::error_code& e, std::size_t){
+						if(e){
+							ptr->file_sent(e);
+						}
+						else{
+							ptr->send_file();
+						}
+					}));
+				}
+				else{
+					file_sent(ec);
+				}
+				return;
+			}
+			auto piece = std::make_shared<std::vector<char>>(static_cast<std::size_t>((std::min)(f.length_,static_cast<std::uint64_t>(piece_size))));
+			if(!read_file_body(f,piece->data(),piece->size(),ec)){
+				file_sent(ec);
+				return;
+			}
+			boost::asio::async_write(*s_,boost::asio::buffer(*piece),strand_.wrap([ptr,piece](const boost::system::error_code& e, std::size_t){
+				if(e || !ptr->responses_.front().file->length_){
+					ptr->file_sent(e);
+				}
+				else{
+					ptr->send_file();
+				}
+			}));
+		}
+
+		void file_sent(const boost::system::error_code& error){
+			writing_ = false;
+			boost::system::error_code e = io_error(error);
+			if(e){
+				write_error_ = e;
+				request req;
+				response res;
+				handler_(req,res,e);
+				boost::system::error_code ec;
+				jrb_shutdown_helper(*s_,ec);
+				return;
+			}
+			responses_.front().complete = true;
+			responses_.front().file.reset();
+			// writes what is ready after it and retires the response
+			flush();
+		}
+
+		void handle_read( const boost::system::error_code& read_error,  std::size_t bytes_transferred ){
+			boost::system::error_code error = io_error(read_error);
+			total_bytes_+= bytes_transferred;
+			buffer_offset_ = 0;
+			buffer_end_ = bytes_transferred;
+			if(is_short_read(error) && total_bytes_==0){
+				// close the connection
+				boost::system::error_code ec;
+				jrb_shutdown_helper(*s_,ec);
+				if(single_message_){
+					request req;
+					response res;
+					handler_(req,res,error);
+				}
+			}
+			else if(error  == boost::asio::error::eof || is_short_read(error) ){ // boost returns short read for ssl termination	
+				eof_ = true;
+				eof_error_ = error;
+				process();
+			}
+			else if(error){
+				end_body(error);
+				request req;
+				response res;
+				handler_(req,res,error);
+			}
+			else{
+				process();
+			}
+
+		}
+		// live connections
+		static std::atomic<int> counter;
+		~jrb_stream_reader(){
+			--counter;
+			if(wheel_) wheel_->clear(deadline_);
+			if(limit_) limit_->release();
+			// a client's socket may be back in the pool by now and must stay usable
+			if(s_ && !single_message_) jrb_keep_session_helper(*s_);
+//			std::cout << --counter << "\n";
 		}
 
 
@@ -237,14 +1402,133 @@ const std::string method_names[] = 	{	// HTTP Method names
 	};
 
 	template <class  AsyncReadStream> 
-	int jrb_stream_reader<AsyncReadStream>::counter = 0;
+	std::atomic<int> jrb_stream_reader<AsyncReadStream>::counter(0);
 
-	void http_server::accept_ec(handler_func func)
+	namespace{
+		void open_acceptor(boost::asio::ip::tcp::acceptor& acceptor, const boost::asio::ip::tcp::endpoint& endpoint, bool reuse_port){
+			acceptor.open(endpoint.protocol());
+			acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+			if(reuse_port){
+				typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+				acceptor.set_option(reuse_port_option(true));
+			}
+#endif
+			acceptor.bind(endpoint);
+			acceptor.listen();
+		}
+
+		const std::string service_unavailable_response =
+			"HTTP/1.1 503 Service Unavailable\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: 19\r\n"
+			"Connection: close\r\n"
+			"Retry-After: 1\r\n"
+			"\r\n"
+			"Service Unavailable";
+
+		// A connection turned away with service_unavailable_response. What the client sent is read
+		// and dropped before closing, for up to linger_milliseconds, since closing with unread data
+		// resets the connection and the client may lose the response
+		struct shed_connection:public std::enable_shared_from_this<shed_connection>{
+			enum{linger_milliseconds = 2000, max_drain = 64 * 1024};
+
+			std::shared_ptr<boost::asio::ip::tcp::socket> s_;
+			timing_wheel_service& wheel_;
+			timing_wheel_service::entry deadline_;
+			std::array<char,1024> buffer_;
+			std::size_t drained_;
+
+			explicit shed_connection(std::shared_ptr<boost::asio::ip::tcp::socket> s)
+				:s_(s),wheel_(boost::asio::use_service<timing_wheel_service>(s->get_io_service())),drained_(0){}
+			~shed_connection(){
+				wheel_.clear(deadline_);
+			}
+
+			void start(){
+				std::weak_ptr<shed_connection> weak = shared_from_this();
+				deadline_.expire_ = [weak](std::uint64_t){
+					if(auto ptr = weak.lock()){
+						boost::system::error_code ec;
+						ptr->s_->shutdown(boost::asio::ip::tcp::socket::shutdown_both,ec);
+					}
+				};
+				wheel_.set(deadline_,linger_milliseconds);
+				auto ptr = shared_from_this();
+				boost::asio::async_write(*s_,boost::asio::buffer(service_unavailable_response),[ptr](const boost::system::error_code& e, std::size_t){
+					if(e) return;
+					boost::system::error_code ec;
+					ptr->s_->shutdown(boost::asio::ip::tcp::socket::shutdown_send,ec);
+					ptr->drain();
+				});
+			}
+
+			void drain(){
+				auto ptr = shared_from_this();
+				s_->async_read_some(boost::asio::buffer(buffer_),[ptr](const boost::system::error_code& e, std::size_t n){
+					ptr->drained_ += n;
+					if(!e && ptr->drained_ < max_drain) ptr->drain();
+				});
+			}
+		};
+
+		void pin_current_thread(std::size_t cpu){
+#if defined(__linux__)
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu % CPU_SETSIZE, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+			SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << (cpu % (sizeof(DWORD_PTR) * 8)));
+#endif
+		}
+	}
+
+	http_server::http_server(boost::asio::io_service& io_service,const std::string& ip, int port, bool reuse_port)
+		: acceptor_(io_service)
 	{
-		connection_ptr new_connection(new stream_reader(acceptor_.get_io_service(),func));
+		open_acceptor(acceptor_,boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(ip), port),reuse_port);
+	}
 
-		acceptor_.async_accept(*new_connection->s_,[this,new_connection,func](const boost::system::error_code& error){
-			accept_ec(func);
+	http_server::~http_server()
+	{
+		if(limit_) limit_->stop();
+	}
+
+	void http_server::set_max_connections(std::size_t max, bool shed)
+	{
+		if(!limit_) limit_ = std::make_shared<connection_limit_state>();
+		limit_->max_ = max;
+		limit_->shed_503_ = shed;
+		limit_->resume_if_room();
+	}
+
+	std::size_t http_server::connections()const{return limit_ ? limit_->live_.load() : 0;}
+	std::uint64_t http_server::shed_connections()const{return limit_ ? limit_->shed_.load() : 0;}
+
+	void http_server::accept_impl(handler_func func, streaming_handler_func stream_func)
+	{
+		if(!limit_) limit_ = std::make_shared<connection_limit_state>();
+		connection_ptr new_connection(new stream_reader(acceptor_.get_io_service(),func));
+		new_connection->stream_handler_ = stream_func;
+		new_connection->timeouts_ = timeouts_;
+
+		auto limit = limit_;
+		acceptor_.async_accept(*new_connection->s_,[this,new_connection,func,stream_func,limit](const boost::system::error_code& error){
+			if(!error && limit->shed_503_ && limit->full()){
+				++limit->shed_;
+				std::make_shared<shed_connection>(new_connection->s_)->start();
+				accept_impl(func,stream_func);
+				return;
+			}
+			if(!error){
+				++limit->live_;
+				new_connection->limit_ = limit;
+			}
+			// at the limit the next accept waits for a connection to go
+			if(!limit->pause(acceptor_.get_io_service(),[this,func,stream_func](){accept_impl(func,stream_func);})){
+				accept_impl(func,stream_func);
+			}
 			if (!error)
 			{
 				new_connection->start();
@@ -255,32 +1539,90 @@ const std::string method_names[] = 	{	// HTTP Method names
 	}
 
 #ifdef JRB_NODE_SSL
-	void https_server::accept_ec(handler_func func)
+	void https_server::accept_impl(handler_func func, streaming_handler_func stream_func)
 	{
 		typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_socket;
 		std::shared_ptr<ssl_socket> s(new ssl_socket(acceptor_.get_io_service(),context_));
 
+		if(!limit_) limit_ = std::make_shared<connection_limit_state>();
 		connection_ptr new_connection(new stream_reader(s,func));
-
-		acceptor_.async_accept(new_connection->socket(),[this,new_connection,func,s](const boost::system::error_code& error)mutable{
-			accept_ec(func);
-
+		new_connection->stream_handler_ = stream_func;
+		new_connection->timeouts_ = timeouts_;
+
+		auto limit = limit_;
+		acceptor_.async_accept(new_connection->socket(),[this,new_connection,func,stream_func,s,limit](const boost::system::error_code& error)mutable{
+			if(!error && limit->shed_503_ && limit->full()){
+				// a 503 would need the handshake first, so the connection is reset without any TLS work
+				++limit->shed_;
+				boost::system::error_code ec;
+				s->lowest_layer().set_option(boost::asio::socket_base::linger(true,0),ec);
+				s->lowest_layer().close(ec);
+				accept_impl(func,stream_func);
+				return;
+			}
 			if(!error){
-				s->async_handshake(boost::asio::ssl::stream_base::server,[this,new_connection,func,s](const boost::system::error_code& error)mutable{
+				++limit->live_;
+				new_connection->limit_ = limit;
+			}
+			if(!limit->pause(acceptor_.get_io_service(),[this,func,stream_func](){accept_impl(func,stream_func);})){
+				accept_impl(func,stream_func);
+			}
 
+			if(!error){
+				// runs on the connection's strand, like its deadline
+				auto handshake_done = [this,new_connection,func,s](const boost::system::error_code& error)mutable{
+					new_connection->handshake_strand_.reset();
 					if (!error)
 					{
+						// the handshake finished before any shutdown, so a deadline did not end it
+						new_connection->timed_out_ = false;
 						new_connection->start();
 					}
 					else{
 						request req;
 						response res;
-						func(req,res,error);
+						func(req,res,new_connection->io_error(error));
 						boost::system::error_code ec;
 						jrb_shutdown_helper(*new_connection->s_,ec);
 					}
 
-				}); // async handshake
+				};
+				tls_handshake_pool* pool = handshake_pool_;
+				if(!pool){
+					new_connection->deadline(stream_reader::phase_handshake);
+#if BOOST_VERSION >= 106600
+					// newer asio goes by the handler's executor rather than the invoke hook of wrap
+					s->async_handshake(boost::asio::ssl::stream_base::server,boost::asio::bind_executor(new_connection->strand_,handshake_done));
+#else
+					s->async_handshake(boost::asio::ssl::stream_base::server,new_connection->strand_.wrap(handshake_done));
+#endif
+				}
+				else if(!pool->try_acquire()){
+					// too many handshakes in progress, reset the connection without doing any TLS work
+					boost::system::error_code ec;
+					s->lowest_layer().set_option(boost::asio::socket_base::linger(true,0),ec);
+					s->lowest_layer().close(ec);
+				}
+				else{
+					// Every step of the handshake runs on a strand of the pool, and the connection
+					// is served on its own strand once it is done
+					auto strand = std::make_shared<boost::asio::io_service::strand>(pool->get_io_service());
+					new_connection->handshake_strand_ = strand;
+					new_connection->deadline(stream_reader::phase_handshake);
+					strand->post([pool,s,strand,new_connection,handshake_done](){
+						auto f = [pool,new_connection,handshake_done](const boost::system::error_code& error){
+							new_connection->handshake_running_ = false;
+							pool->release();
+							new_connection->strand_.post([handshake_done,error]()mutable{handshake_done(error);});
+						};
+						new_connection->handshake_running_ = true;
+#if BOOST_VERSION >= 106600
+						s->async_handshake(boost::asio::ssl::stream_base::server,boost::asio::bind_executor(*strand,f));
+#else
+						s->async_handshake(boost::asio::ssl::stream_base::server,strand->wrap(f));
+#endif
+					});
+				}
 			}
 			else{
 				request req;
@@ -295,73 +1637,944 @@ const std::string method_names[] = 	{	// HTTP Method names
 		}); // async accept
 	}
 
+	https_server::https_server(boost::asio::io_service& io_service,const std::string& ip, int port,boost::asio::ssl::context& c, bool reuse_port)
+		: acceptor_(io_service),context_(c),handshake_pool_(nullptr)
+	{
+		open_acceptor(acceptor_,boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(ip), port),reuse_port);
+	}
+
+	https_server::~https_server()
+	{
+		if(limit_) limit_->stop();
+	}
+
+	void https_server::set_max_connections(std::size_t max, bool shed)
+	{
+		if(!limit_) limit_ = std::make_shared<connection_limit_state>();
+		limit_->max_ = max;
+		limit_->shed_503_ = shed;
+		limit_->resume_if_room();
+	}
+
+	std::size_t https_server::connections()const{return limit_ ? limit_->live_.load() : 0;}
+	std::uint64_t https_server::shed_connections()const{return limit_ ? limit_->shed_.load() : 0;}
+
+	struct tls_handshake_pool_impl{
+		boost::asio::io_service io_;
+		std::unique_ptr<boost::asio::io_service::work> work_;
+		boost::thread_group threads_;
+		std::size_t max_pending_;
+		std::atomic<std::size_t> pending_;
+		std::atomic<std::uint64_t> shed_;
+	};
+
+	tls_handshake_pool::tls_handshake_pool(std::size_t threads, std::size_t max_pending):impl_(new tls_handshake_pool_impl){
+		impl_->max_pending_ = max_pending;
+		impl_->pending_ = 0;
+		impl_->shed_ = 0;
+		impl_->work_.reset(new boost::asio::io_service::work(impl_->io_));
+		if(!threads) threads = 1;
+		tls_handshake_pool_impl* impl = impl_.get();
+		for(std::size_t i = 0; i < threads; ++i){
+			impl_->threads_.create_thread([impl](){impl->io_.run();});
+		}
+	}
+
+	tls_handshake_pool::~tls_handshake_pool(){
+		impl_->work_.reset();
+		impl_->io_.stop();
+		impl_->threads_.join_all();
+	}
+
+	std::size_t tls_handshake_pool::pending()const{return impl_->pending_;}
+	std::uint64_t tls_handshake_pool::shed()const{return impl_->shed_;}
+	boost::asio::io_service& tls_handshake_pool::get_io_service(){return impl_->io_;}
+
+	bool tls_handshake_pool::try_acquire(){
+		if(++impl_->pending_ > impl_->max_pending_){
+			--impl_->pending_;
+			++impl_->shed_;
+			return false;
+		}
+		return true;
+	}
+
+	void tls_handshake_pool::release(){
+		--impl_->pending_;
+	}
+
+	// tls_session_cache
+	namespace{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		typedef const unsigned char* session_id_data;
+#else
+		typedef unsigned char* session_id_data;
+#endif
+		struct ticket_key{
+			unsigned char name[16];
+			unsigned char aes_key[32];
+			unsigned char hmac_key[32];
+		};
+	}
+
+	struct tls_session_cache_impl{
+		struct shard{
+			typedef std::list<std::pair<std::string,std::string>> lru_type;
+			boost::mutex mutex_;
+			// most recently used first, holding the session id and the serialized session
+			lru_type lru_;
+			std::unordered_map<std::string,lru_type::iterator> index_;
+		};
+
+		SSL_CTX* ctx_;
+		std::vector<std::unique_ptr<shard>> shards_;
+		std::size_t max_per_shard_;
+
+		boost::mutex key_mutex_;
+		ticket_key current_key_;
+		ticket_key previous_key_;
+		bool has_previous_key_;
+		std::chrono::steady_clock::time_point key_expires_;
+		std::chrono::steady_clock::duration key_lifetime_;
+
+		std::atomic<std::uint64_t> cache_hits_;
+		std::atomic<std::uint64_t> cache_misses_;
+		std::atomic<std::uint64_t> ticket_hits_;
+		std::atomic<std::uint64_t> ticket_misses_;
+		std::atomic<std::uint64_t> ticket_key_rotations_;
+
+		static int ex_index(){
+			static int index = SSL_CTX_get_ex_new_index(0,nullptr,nullptr,nullptr,nullptr);
+			return index;
+		}
+		static tls_session_cache_impl* get(SSL_CTX* ctx){
+			return static_cast<tls_session_cache_impl*>(SSL_CTX_get_ex_data(ctx,ex_index()));
+		}
+
+		shard& shard_for(const std::string& id){
+			return *shards_[std::hash<std::string>()(id) % shards_.size()];
+		}
+
+		static int new_session(SSL* ssl, SSL_SESSION* session){
+			tls_session_cache_impl* impl = get(SSL_get_SSL_CTX(ssl));
+			unsigned int id_length = 0;
+			const unsigned char* id = SSL_SESSION_get_id(session,&id_length);
+			int length = i2d_SSL_SESSION(session,nullptr);
+			if(!impl || !id_length || length <= 0) return 0;
+			std::string key(reinterpret_cast<const char*>(id),id_length);
+			std::string value(length,'\0');
+			unsigned char* p = reinterpret_cast<unsigned char*>(&value[0]);
+			i2d_SSL_SESSION(session,&p);
+
+			shard& s = impl->shard_for(key);
+			boost::mutex::scoped_lock lock(s.mutex_);
+			auto iter = s.index_.find(key);
+			if(iter != s.index_.end()){
+				s.lru_.erase(iter->second);
+				s.index_.erase(iter);
+			}
+			s.lru_.push_front(std::make_pair(key,std::move(value)));
+			s.index_[key] = s.lru_.begin();
+			if(s.lru_.size() > impl->max_per_shard_){
+				s.index_.erase(s.lru_.back().first);
+				s.lru_.pop_back();
+			}
+			// we keep our own copy, not a reference to session
+			return 0;
+		}
+
+		static SSL_SESSION* get_session(SSL* ssl, session_id_data data, int length, int* copy){
+			*copy = 0;
+			tls_session_cache_impl* impl = get(SSL_get_SSL_CTX(ssl));
+			if(!impl) return nullptr;
+			std::string key(reinterpret_cast<const char*>(data),length);
+			std::string value;
+			{
+				shard& s = impl->shard_for(key);
+				boost::mutex::scoped_lock lock(s.mutex_);
+				auto iter = s.index_.find(key);
+				if(iter != s.index_.end()){
+					s.lru_.splice(s.lru_.begin(),s.lru_,iter->second);
+					value = iter->second->second;
+				}
+			}
+			if(value.empty()){
+				++impl->cache_misses_;
+				return nullptr;
+			}
+			++impl->cache_hits_;
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(value.data());
+			return d2i_SSL_SESSION(nullptr,&p,static_cast<long>(value.size()));
+		}
+
+		static void remove_session(SSL_CTX* ctx, SSL_SESSION* session){
+			tls_session_cache_impl* impl = get(ctx);
+			unsigned int id_length = 0;
+			const unsigned char* id = SSL_SESSION_get_id(session,&id_length);
+			if(!impl || !id_length) return;
+			std::string key(reinterpret_cast<const char*>(id),id_length);
+			shard& s = impl->shard_for(key);
+			boost::mutex::scoped_lock lock(s.mutex_);
+			auto iter = s.index_.find(key);
+			if(iter != s.index_.end()){
+				s.lru_.erase(iter->second);
+				s.index_.erase(iter);
+			}
+		}
+
+		// Picks the key of a ticket and sets up cipher with it. Returns what the ticket callback
+		// returns, with key set when that is positive
+		static int select_ticket_key(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, int encrypt, ticket_key& key){
+			tls_session_cache_impl* impl = get(SSL_get_SSL_CTX(ssl));
+			if(!impl) return 0;
+			int result = 1;
+			{
+				boost::mutex::scoped_lock lock(impl->key_mutex_);
+				if(std::chrono::steady_clock::now() >= impl->key_expires_){
+					impl->rotate_locked();
+				}
+				if(encrypt){
+					key = impl->current_key_;
+				}
+				else if(std::equal(name,name + sizeof(key.name),impl->current_key_.name)){
+					key = impl->current_key_;
+#ifdef TLS1_3_VERSION
+					// TLS 1.3 clients use a ticket once, a resumed connection only gets a new one if asked for
+					if(SSL_version(ssl) >= TLS1_3_VERSION) result = 2;
+#endif
+				}
+				else if(impl->has_previous_key_ && std::equal(name,name + sizeof(key.name),impl->previous_key_.name)){
+					key = impl->previous_key_;
+					// ask the client to replace its ticket
+					result = 2;
+				}
+				else{
+					++impl->ticket_misses_;
+					return 0;
+				}
+			}
+			if(encrypt){
+				if(RAND_bytes(iv,EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) return -1;
+				std::copy(key.name,key.name + sizeof(key.name),name);
+				EVP_EncryptInit_ex(cipher,EVP_aes_256_cbc(),nullptr,key.aes_key,iv);
+			}
+			else{
+				++impl->ticket_hits_;
+				EVP_DecryptInit_ex(cipher,EVP_aes_256_cbc(),nullptr,key.aes_key,iv);
+			}
+			return result;
+		}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		static int ticket_key_callback(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int encrypt){
+			ticket_key key;
+			int result = select_ticket_key(ssl,name,iv,cipher,encrypt,key);
+			if(result <= 0) return result;
+			OSSL_PARAM params[] = {
+				OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,const_cast<char*>("SHA256"),0),
+				OSSL_PARAM_construct_end()
+			};
+			if(!EVP_MAC_init(mac,key.hmac_key,sizeof(key.hmac_key),params)) return -1;
+			return result;
+		}
+#else
+		static int ticket_key_callback(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cipher, HMAC_CTX* hmac, int encrypt){
+			ticket_key key;
+			int result = select_ticket_key(ssl,name,iv,cipher,encrypt,key);
+			if(result <= 0) return result;
+			HMAC_Init_ex(hmac,key.hmac_key,sizeof(key.hmac_key),EVP_sha256(),nullptr);
+			return result;
+		}
+#endif
+
+		void rotate_locked(){
+			previous_key_ = current_key_;
+			has_previous_key_ = true;
+			RAND_bytes(reinterpret_cast<unsigned char*>(&current_key_),sizeof(current_key_));
+			key_expires_ = std::chrono::steady_clock::now() + key_lifetime_;
+			++ticket_key_rotations_;
+		}
+	};
+
+	tls_session_cache::tls_session_cache(boost::asio::ssl::context& c, std::size_t max_sessions, std::size_t shards, long ticket_key_lifetime_seconds)
+		:impl_(new tls_session_cache_impl)
+	{
+		if(!shards) shards = 1;
+		impl_->ctx_ = c.native_handle();
+		for(std::size_t i = 0; i < shards; ++i){
+			impl_->shards_.emplace_back(new tls_session_cache_impl::shard);
+		}
+		impl_->max_per_shard_ = (std::max)(max_sessions / shards,static_cast<std::size_t>(1));
+		impl_->key_lifetime_ = std::chrono::seconds(ticket_key_lifetime_seconds);
+		impl_->has_previous_key_ = false;
+		impl_->cache_hits_ = 0;
+		impl_->cache_misses_ = 0;
+		impl_->ticket_hits_ = 0;
+		impl_->ticket_misses_ = 0;
+		impl_->ticket_key_rotations_ = 0;
+		RAND_bytes(reinterpret_cast<unsigned char*>(&impl_->current_key_),sizeof(impl_->current_key_));
+		impl_->key_expires_ = std::chrono::steady_clock::now() + impl_->key_lifetime_;
+
+		SSL_CTX* ctx = impl_->ctx_;
+		SSL_CTX_set_ex_data(ctx,tls_session_cache_impl::ex_index(),impl_.get());
+		static const unsigned char session_id_context[] = "jrb_node";
+		SSL_CTX_set_session_id_context(ctx,session_id_context,sizeof(session_id_context) - 1);
+		SSL_CTX_set_session_cache_mode(ctx,SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(ctx,&tls_session_cache_impl::new_session);
+		SSL_CTX_sess_set_get_cb(ctx,&tls_session_cache_impl::get_session);
+		SSL_CTX_sess_set_remove_cb(ctx,&tls_session_cache_impl::remove_session);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx,&tls_session_cache_impl::ticket_key_callback);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx,&tls_session_cache_impl::ticket_key_callback);
+#endif
+	}
+
+	tls_session_cache::~tls_session_cache(){
+		SSL_CTX* ctx = impl_->ctx_;
+		SSL_CTX_sess_set_new_cb(ctx,nullptr);
+		SSL_CTX_sess_set_get_cb(ctx,nullptr);
+		SSL_CTX_sess_set_remove_cb(ctx,nullptr);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx,nullptr);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx,nullptr);
+#endif
+		SSL_CTX_set_session_cache_mode(ctx,SSL_SESS_CACHE_SERVER);
+		SSL_CTX_set_ex_data(ctx,tls_session_cache_impl::ex_index(),nullptr);
+	}
+
+	tls_session_cache::stats_type tls_session_cache::stats()const{
+		stats_type s;
+		s.cache_hits = impl_->cache_hits_;
+		s.cache_misses = impl_->cache_misses_;
+		s.ticket_hits = impl_->ticket_hits_;
+		s.ticket_misses = impl_->ticket_misses_;
+		s.ticket_key_rotations = impl_->ticket_key_rotations_;
+		return s;
+	}
+
+	void tls_session_cache::rotate_ticket_keys(){
+		boost::mutex::scoped_lock lock(impl_->key_mutex_);
+		impl_->rotate_locked();
+	}
+
+#endif
+
+	// server_group
+	template<class Server>
+	server_group<Server>::server_group(std::size_t loops, factory_func f, bool pin_threads):pin_threads_(pin_threads){
+		if(loops == 0){
+			loops = (std::max)(1u,boost::thread::hardware_concurrency());
+		}
+		for(std::size_t i = 0; i < loops; ++i){
+			io_services_.emplace_back(new boost::asio::io_service(1));
+			servers_.push_back(f(*io_services_.back()));
+		}
+	}
+
+	template<class Server>
+	void server_group<Server>::accept_ec(handler_func func){
+		for(auto& s:servers_){
+			s->accept_ec(func);
+		}
+	}
+
+	template<class Server>
+	void server_group<Server>::accept(simple_handler_func f){
+		for(auto& s:servers_){
+			s->accept(f);
+		}
+	}
+
+	template<class Server>
+	void server_group<Server>::accept_streaming(streaming_handler_func f){
+		for(auto& s:servers_){
+			s->accept_streaming(f);
+		}
+	}
+
+	template<class Server>
+	void server_group<Server>::set_error_function(simple_error_func func){
+		for(auto& s:servers_){
+			s->set_error_function(func);
+		}
+	}
+
+	template<class Server>
+	void server_group<Server>::set_timeouts(const connection_timeouts& t){
+		for(auto& s:servers_){
+			s->set_timeouts(t);
+		}
+	}
+
+	template<class Server>
+	void server_group<Server>::set_max_connections(std::size_t max, bool shed){
+		for(auto& s:servers_){
+			s->set_max_connections(max,shed);
+		}
+	}
+
+	template<class Server>
+	void server_group<Server>::run(){
+		boost::thread_group threads;
+		for(std::size_t i = 0; i < io_services_.size(); ++i){
+			boost::asio::io_service* io = io_services_[i].get();
+			bool pin = pin_threads_;
+			threads.create_thread([io,pin,i](){
+				if(pin){
+					pin_current_thread(i);
+				}
+				io->run();
+			});
+		}
+		threads.join_all();
+	}
+
+	template<class Server>
+	void server_group<Server>::stop(){
+		for(auto& io:io_services_){
+			io->stop();
+		}
+	}
+
+	template class server_group<http_server>;
+#ifdef JRB_NODE_SSL
+	template class server_group<https_server>;
+#endif
+
+#ifdef JRB_NODE_SSL
+	namespace{
+		// The client context, which also remembers the last TLS session per schema/host/port so
+		// that reconnects to the same server can resume it instead of doing a full handshake
+		struct jrb_client_default_context{
+			typedef std::list<std::pair<std::string,SSL_SESSION*>> lru_type;
+			boost::asio::ssl::context context_;
+			boost::mutex sessions_mutex_;
+			// most recently used first, holding the key and our reference to the session
+			lru_type lru_;
+			std::unordered_map<std::string,lru_type::iterator> sessions_;
+			enum{max_sessions = 1024};
+
+			jrb_client_default_context():context_(boost::asio::ssl::context::sslv23){
+				context_.set_default_verify_paths();
+				// Sessions arrive through new_session, also the ones TLS 1.3 sends after the handshake
+				SSL_CTX_set_session_cache_mode(context_.native_handle(),SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+				SSL_CTX_sess_set_new_cb(context_.native_handle(),&jrb_client_default_context::new_session);
+			}
+			~jrb_client_default_context(){
+				for(auto& p:lru_){
+					SSL_SESSION_free(p.second);
+				}
+			}
+
+			static void free_session_key(void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*){
+				delete static_cast<std::string*>(ptr);
+			}
+			static int session_key_index(){
+				static int index = SSL_get_ex_new_index(0,nullptr,nullptr,nullptr,&jrb_client_default_context::free_session_key);
+				return index;
+			}
+
+			// Tags the connection with key and offers the session remembered for it
+			void offer_session(SSL* ssl, const std::string& key){
+				SSL_set_ex_data(ssl,session_key_index(),new std::string(key));
+				boost::mutex::scoped_lock lock(sessions_mutex_);
+				auto iter = sessions_.find(key);
+				if(iter != sessions_.end()){
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+					// a TLS 1.3 session that was already used
+					if(!SSL_SESSION_is_resumable(iter->second->second)){
+						remove(iter);
+						return;
+					}
+#endif
+					lru_.splice(lru_.begin(),lru_,iter->second);
+					SSL_set_session(ssl,iter->second->second);
+				}
+			}
+
+			void forget_session(const std::string& key){
+				boost::mutex::scoped_lock lock(sessions_mutex_);
+				auto iter = sessions_.find(key);
+				if(iter != sessions_.end()){
+					remove(iter);
+				}
+			}
+
+			void remove(std::unordered_map<std::string,lru_type::iterator>::iterator iter){
+				SSL_SESSION_free(iter->second->second);
+				lru_.erase(iter->second);
+				sessions_.erase(iter);
+			}
+
+			static int new_session(SSL* ssl, SSL_SESSION* session){
+				std::string* key = static_cast<std::string*>(SSL_get_ex_data(ssl,session_key_index()));
+				if(!key) return 0;
+				jrb_client_default_context& def = get_default();
+				boost::mutex::scoped_lock lock(def.sessions_mutex_);
+				auto iter = def.sessions_.find(*key);
+				if(iter != def.sessions_.end()){
+					SSL_SESSION_free(iter->second->second);
+					iter->second->second = session;
+					def.lru_.splice(def.lru_.begin(),def.lru_,iter->second);
+				}
+				else{
+					if(def.lru_.size() >= max_sessions){
+						def.remove(def.sessions_.find(def.lru_.back().first));
+					}
+					def.lru_.push_front(std::make_pair(*key,session));
+					def.sessions_[*key] = def.lru_.begin();
+				}
+				// we keep the reference to session
+				return 1;
+			}
+
+			static jrb_client_default_context& get_default(){
+				static jrb_client_default_context def;
+				return def;
+			}
+		};
+
+	}
 #endif
 
 	namespace{
 		template<class Func>
-		void async_do_client_handshake(const std::string& host, boost::asio::ip::tcp::socket& sock, Func f){
+		void async_do_client_handshake(const std::string&, boost::asio::ip::tcp::socket&, Func f){
 			boost::system::error_code ec;
 			f(ec);
 		}
 
 #ifdef JRB_NODE_SSL
 		template<class Func>
-		void async_do_client_handshake(const std::string& host, boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& sock, Func f){
+		void async_do_client_handshake(const std::string& session_key, boost::asio::ssl::stream<boost::asio::ip::tcp::socket>& sock, Func f){
 
 			using boost::asio::ip::tcp;
 			namespace ssl = boost::asio::ssl;
 			typedef ssl::stream<tcp::socket> ssl_socket;
 			sock.lowest_layer().set_option(tcp::no_delay(true));
 			sock.set_verify_mode(ssl::verify_none);
-			sock.async_handshake(ssl_socket::client,f);
+			jrb_client_default_context::get_default().offer_session(sock.native_handle(),session_key);
+			sock.async_handshake(ssl_socket::client,[session_key,f](const boost::system::error_code& err){
+				if(err){
+					// do not offer a session the server may have choked on again
+					jrb_client_default_context::get_default().forget_session(session_key);
+				}
+				f(err);
+			});
 		}
 
 #endif
 
 	}
 
+	namespace{
+		void create_client_socket(boost::asio::io_service& io, std::shared_ptr<boost::asio::ip::tcp::socket>& s){
+			s.reset(new boost::asio::ip::tcp::socket(io));
+		}
+#ifdef JRB_NODE_SSL
+		// Runs once the pool and every request are done with the socket, so its session stays
+		// resumable even though the connection ends without close_notify
+		void delete_client_socket(boost::asio::ssl::stream<boost::asio::ip::tcp::socket>* s){
+			jrb_keep_session_helper(*s);
+			delete s;
+		}
+		void create_client_socket(boost::asio::io_service& io, std::shared_ptr<boost::asio::ssl::stream<boost::asio::ip::tcp::socket>>& s){
+			s.reset(new boost::asio::ssl::stream<boost::asio::ip::tcp::socket>(io,jrb_client_default_context::get_default().context_),&delete_client_socket);
+		}
+#endif
+	}
+
+	namespace{
+		// false if the other side has closed an idle connection, or sent something it should not have
+		bool idle_socket_open(boost::asio::ip::tcp::socket& s){
+			boost::system::error_code ec;
+			s.non_blocking(true,ec);
+			if(ec) return false;
+			char c;
+			s.receive(boost::asio::buffer(&c,1),boost::asio::ip::tcp::socket::message_peek,ec);
+			boost::system::error_code ignored;
+			s.non_blocking(false,ignored);
+			return ec == boost::asio::error::would_block;
+		}
+	}
+
+	// Keeps client connections open between requests, per io_service and per schema/host/port.
+	// Connections idle for longer than the idle timeout are closed, and one the server closed
+	// meanwhile is dropped when it is next asked for. Both are checked as the pool is used rather
+	// than on a timer, so idle connections do not keep the io_service from running out of work.
+	// As an io_service service the pooled sockets are destroyed along with their io_service
+	template<class SocketType>
+	class client_pool_service:public boost::asio::io_service::service{
+	public:
+		typedef std::shared_ptr<SocketType> s_type;
+		typedef std::function<void(s_type)> acquire_func;
+		typedef std::chrono::steady_clock clock;
+
+		static boost::asio::io_service::id id;
+
+		explicit client_pool_service(boost::asio::io_service& io):boost::asio::io_service::service(io),io_(io),max_per_host_(8),
+			idle_timeout_(std::chrono::milliseconds(30000)),next_sweep_(clock::now()){}
+
+		void shutdown_service(){
+			boost::mutex::scoped_lock lock(mutex_);
+			hosts_.clear();
+		}
+		void shutdown(){shutdown_service();}
+
+		void max_per_host(std::size_t n){
+			boost::mutex::scoped_lock lock(mutex_);
+			max_per_host_ = n ? n : 1;
+		}
+
+		// 0 keeps idle connections until the server closes them
+		void idle_timeout(long milliseconds){
+			boost::mutex::scoped_lock lock(mutex_);
+			idle_timeout_ = std::chrono::milliseconds(milliseconds);
+		}
+
+		// Calls f with an idle connection, or with an empty pointer when the caller may open a
+		// new one. If the host already has the maximum number of connections f waits in line
+		void acquire(const std::string& key, acquire_func f){
+			s_type s;
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				auto now = clock::now();
+				if(now >= next_sweep_) sweep(now);
+				host& h = hosts_[key];
+				while(!s && h.idle.size()){
+					idle_connection c = h.idle.back();
+					h.idle.pop_back();
+					if(!expired(c,now) && idle_socket_open(jrb_tcp_socket(*c.socket))){
+						s = c.socket;
+					}
+					else{
+						--h.active;
+					}
+				}
+				if(s){
+				}
+				else if(h.active < max_per_host_){
+					++h.active;
+				}
+				else{
+					h.waiting.push_back(f);
+					return;
+				}
+			}
+			f(s);
+		}
+
+		// Gives back a connection from acquire. A reusable connection goes to the next waiting
+		// request or is kept idle, otherwise its slot goes to the next waiting request
+		void release(const std::string& key, s_type s, bool reusable){
+			acquire_func next;
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				host& h = hosts_[key];
+				if(!reusable){
+					s.reset();
+				}
+				if(h.waiting.size()){
+					next = h.waiting.front();
+					h.waiting.pop_front();
+				}
+				else if(s){
+					idle_connection c = {s,clock::now()};
+					h.idle.push_back(c);
+					return;
+				}
+				else{
+					if(!--h.active) hosts_.erase(key);
+					return;
+				}
+			}
+			io_.post([next,s](){next(s);});
+		}
+
+	private:
+		struct idle_connection{
+			s_type socket;
+			clock::time_point since;
+		};
+
+		struct host{
+			host():active(0){}
+			// connections that are open or being opened, including idle ones
+			std::size_t active;
+			// oldest first
+			std::vector<idle_connection> idle;
+			std::deque<acquire_func> waiting;
+		};
+
+		enum{sweep_milliseconds = 1000};
+
+		bool expired(const idle_connection& c, clock::time_point now)const{
+			return idle_timeout_ > clock::duration::zero() && now - c.since >= idle_timeout_;
+		}
+
+		// Closes the connections of every host that have been idle too long, and forgets hosts
+		// left without connections. Runs at most once every sweep_milliseconds
+		void sweep(clock::time_point now){
+			next_sweep_ = now + std::chrono::milliseconds(sweep_milliseconds);
+			for(auto iter = hosts_.begin(); iter != hosts_.end();){
+				host& h = iter->second;
+				auto keep = std::find_if(h.idle.begin(),h.idle.end(),[this,now](const idle_connection& c){return !expired(c,now);});
+				h.active -= keep - h.idle.begin();
+				h.idle.erase(h.idle.begin(),keep);
+				if(!h.active){
+					iter = hosts_.erase(iter);
+				}
+				else{
+					++iter;
+				}
+			}
+		}
+
+		boost::asio::io_service& io_;
+		boost::mutex mutex_;
+		std::map<std::string,host> hosts_;
+		std::size_t max_per_host_;
+		clock::duration idle_timeout_;
+		clock::time_point next_sweep_;
+	};
+
+	template<class SocketType>
+	boost::asio::io_service::id client_pool_service<SocketType>::id;
+
+	// Caches host name lookups for the clients of an io_service. Results are kept for a fixed
+	// ttl and failures for a shorter negative ttl. A lookup in the last part of an entry's life
+	// is answered from the cache while the entry is refreshed in the background, and concurrent
+	// lookups of a host that is being resolved share the one resolve
+	class resolver_cache_service:public boost::asio::io_service::service{
+	public:
+		typedef boost::asio::ip::tcp::resolver::iterator iterator;
+		typedef std::function<void(const boost::system::error_code&, iterator)> resolve_func;
+		typedef std::chrono::steady_clock clock;
+
+		static boost::asio::io_service::id id;
+
+		explicit resolver_cache_service(boost::asio::io_service& io):boost::asio::io_service::service(io),io_(io),
+			ttl_(std::chrono::seconds(60)),negative_ttl_(std::chrono::seconds(5)),sweep_at_(min_sweep){}
+
+		void shutdown_service(){
+			boost::mutex::scoped_lock lock(mutex_);
+			entries_.clear();
+		}
+		void shutdown(){shutdown_service();}
+
+		void ttl(clock::duration ttl, clock::duration negative_ttl){
+			boost::mutex::scoped_lock lock(mutex_);
+			ttl_ = ttl;
+			negative_ttl_ = negative_ttl;
+		}
+
+		void async_resolve(const std::string& host, const std::string& port, resolve_func f){
+			std::string key = host + ":" + port;
+			bool start = false;
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				auto now = clock::now();
+				if(entries_.size() >= sweep_at_) sweep(now);
+				entry& e = entries_[key];
+				if(e.valid && now < e.expires){
+					if(!e.error && !e.resolving && now >= e.expires - ttl_ / 10){
+						e.resolving = true;
+						start = true;
+					}
+					auto error = e.error;
+					auto endpoints = e.endpoints;
+					io_.post([f,error,endpoints](){f(error,endpoints);});
+				}
+				else{
+					e.waiting.push_back(f);
+					if(!e.resolving){
+						e.resolving = true;
+						start = true;
+					}
+				}
+			}
+			if(start){
+				start_resolve(key,host,port);
+			}
+		}
+
+	private:
+		struct entry{
+			entry():valid(false),resolving(false){}
+			bool valid;
+			bool resolving;
+			boost::system::error_code error;
+			iterator endpoints;
+			clock::time_point expires;
+			std::vector<resolve_func> waiting;
+		};
+
+		enum{min_sweep = 64};
+
+		// Drops the expired entries no lookup is waiting on. Runs once the map has grown to twice
+		// what was left by the last sweep, so the map stays within twice the hosts in use
+		void sweep(clock::time_point now){
+			for(auto iter = entries_.begin(); iter != entries_.end();){
+				const entry& e = iter->second;
+				if(!e.resolving && e.valid && now >= e.expires){
+					iter = entries_.erase(iter);
+				}
+				else{
+					++iter;
+				}
+			}
+			sweep_at_ = std::max<std::size_t>(min_sweep,entries_.size() * 2);
+		}
+
+		void start_resolve(const std::string& key, const std::string& host, const std::string& port){
+			auto resolver = std::make_shared<boost::asio::ip::tcp::resolver>(io_);
+			boost::asio::ip::tcp::resolver::query query(host,port);
+			resolver->async_resolve(query,[this,resolver,key](const boost::system::error_code& err, iterator endpoints){
+				std::vector<resolve_func> waiting;
+				boost::system::error_code error;
+				iterator result;
+				{
+					boost::mutex::scoped_lock lock(mutex_);
+					entry& e = entries_[key];
+					e.resolving = false;
+					auto now = clock::now();
+					if(!err){
+						e.error = err;
+						e.endpoints = endpoints;
+						e.expires = now + ttl_;
+					}
+					else if(!(e.valid && !e.error && now < e.expires)){
+						// a failed background refresh keeps serving the old result until it expires
+						e.error = err;
+						e.endpoints = iterator();
+						e.expires = now + negative_ttl_;
+					}
+					e.valid = true;
+					waiting.swap(e.waiting);
+					error = e.error;
+					result = e.endpoints;
+				}
+				for(auto& f:waiting){
+					f(error,result);
+				}
+			});
+		}
+
+		boost::asio::io_service& io_;
+		boost::mutex mutex_;
+		std::map<std::string,entry> entries_;
+		clock::duration ttl_;
+		clock::duration negative_ttl_;
+		std::size_t sweep_at_;
+	};
+
+	boost::asio::io_service::id resolver_cache_service::id;
+
 	template<class SocketType>
 	struct async_http_client_holder:public std::enable_shared_from_this<async_http_client_holder<SocketType>>{
 		typedef std::function<void(const uri&, const client_response&, const boost::system::error_code& )> handler_func;  
-		boost::asio::ip::tcp::resolver resolver_;
+		boost::asio::io_service& io_;
+		resolver_cache_service& resolver_;
 		typedef std::shared_ptr<SocketType> s_type;
 		s_type socket_;
-		boost::asio::streambuf request_;
-		boost::asio::streambuf response_;
+		client_pool_service<SocketType>& pool_;
+		std::string pool_key_;
+		std::string request_;
+		// the connection came from the pool, so the server may have closed it in the meantime
+		bool reused_;
+		// the request may be sent again on a new connection if the pooled one turns out closed
+		bool idempotent_;
+		// see async_http_client
+		bool raw_body_;
+		std::size_t compress_min_;
+		std::size_t max_decoded_;
 
 		uri uri_;
-		std::string body_;
-		async_http_client_holder(const uri& u,boost::asio::io_service& io):uri_(u),socket_(new SocketType(io)),resolver_(io){};
-		async_http_client_holder(const uri& u,boost::asio::io_service& io,s_type s):uri_(u),socket_(s),resolver_(io){};
+		async_http_client_holder(const uri& u,boost::asio::io_service& io):io_(io),resolver_(boost::asio::use_service<resolver_cache_service>(io)),
+			pool_(boost::asio::use_service<client_pool_service<SocketType>>(io)),reused_(false),idempotent_(false),raw_body_(false),compress_min_(0),max_decoded_(0),uri_(u){
+			pool_key_ = uri_.origin().to_string();
+		};
 		void set_uri(const uri& u){uri_ = u;}
-		void get(handler_func f){
-			std::ostream request_stream(&request_);
-			request_stream << "GET " << uri_.get_uri_client_request_string() << " HTTP/1.0\r\n";
-			request_stream << "Host: " << uri_.host() << "\r\n";
+
+		// the resolver's service, the schema when the uri has no port
+		std::string port(){
+			if(uri_.port()) return boost::lexical_cast<std::string>(uri_.port());
+			return uri_.schema().to_string();
+		}
+
+		void write_request_line(std::ostream& request_stream, const char* method){
+			string_ref target = uri_.get_uri_client_request_string();
+			request_stream << method << " ";
+			if(target.empty() || target[0] != '/') request_stream << '/';
+			request_stream.write(target.data(),target.size());
+			request_stream << " HTTP/1.1\r\n";
+			request_stream << "Host: ";
+			string_ref host = uri_.host();
+			bool ipv6 = std::find(host.begin(),host.end(),':') != host.end();
+			if(ipv6) request_stream << '[';
+			request_stream.write(host.data(),host.size());
+			if(ipv6) request_stream << ']';
+			if(uri_.port()) request_stream << ":" << uri_.port();
+			request_stream << "\r\n";
 			request_stream << "Accept: */*\r\n";
-			request_stream << "Connection: close\r\n";
+			request_stream << "Accept-Encoding: gzip, deflate\r\n";
+			request_stream << "Connection: keep-alive\r\n";
+		}
+		void get(handler_func f){
+			std::ostringstream request_stream;
+			write_request_line(request_stream,"GET");
 			request_stream << "\r\n";
+			request_ = request_stream.str();
+			idempotent_ = true;
+			request_impl(f);
+
+		}
+		void post(const std::string& data,const std::string& content_type,handler_func f){
+			std::ostringstream request_stream;
+			write_request_line(request_stream,"POST");
+			request_stream << "Content-Type: " << content_type << "\r\n";
+			std::string compressed;
+			if(compress_min_ && data.size() >= compress_min_ && gzip_encode(data,compressed) && compressed.size() < data.size()){
+				request_stream << "Content-Encoding: gzip\r\n";
+			}
+			else{
+				compressed.clear();
+			}
+			const std::string& body = compressed.size() ? compressed : data;
+			request_stream << "Content-Length: " << body.size() << "\r\n\r\n";
+			request_ = request_stream.str();
+			request_ += body;
+			idempotent_ = false;
 			request_impl(f);
 
 		}
-		void post(const std::string& data,const std::string& content_type,handler_func f){
-			std::ostream request_stream(&request_);
-			request_stream << "POST " << uri_.get_uri_client_request_string() << " HTTP/1.0\r\n";
-			request_stream << "Host: " << uri_.host() << "\r\n";
-			request_stream << "Accept: */*\r\n";
-			request_stream << "Content-Type: " << content_type << "\r\n";
-			request_stream << "Content-Length: " << data.size() << "\r\n";
-			request_stream << "Connection: close\r\n\r\n";
-			request_stream << data;
-			request_impl(f);
+		void request_impl(handler_func f){
+			auto ptr =  this->shared_from_this();
+			pool_.acquire(pool_key_,[ptr,f](s_type s){
+				if(s){
+					ptr->socket_ = s;
+					ptr->reused_ = true;
+					ptr->send_request(f);
+				}
+				else{
+					ptr->connect(f);
+				}
+			});
+		}
 
+		void fail(handler_func f, const boost::system::error_code& err){
+			pool_.release(pool_key_,socket_,false);
+			client_response res;
+			f(uri_,res,err);
 		}
-		void request_impl(handler_func f){
-			std::string port = uri_.port();
-			if(port.empty()) port = uri_.schema();
-			boost::asio::ip::tcp::resolver::query query(uri_.host(), port);
+
+		void connect(handler_func f){
+			create_client_socket(io_,socket_);
+			reused_ = false;
 			auto ptr =  this->shared_from_this();
-			resolver_.async_resolve(query,[ptr,f](const boost::system::error_code& err,
+			resolver_.async_resolve(uri_.host().to_string(),port(),[ptr,f](const boost::system::error_code& err,
 				boost::asio::ip::tcp::resolver::iterator endpoint_iterator) -> void
 			{
 				if (!err)
@@ -373,27 +2586,12 @@ const std::string method_names[] = 	{	// HTTP Method names
 						if (!err)
 						{
 							// The connection was successful. Do handshake if we need to
-							async_do_client_handshake(ptr->uri_.host(), *ptr->socket_,[ptr,f](const boost::system::error_code& err){
+							async_do_client_handshake(ptr->pool_key_, *ptr->socket_,[ptr,f](const boost::system::error_code& err){
 								if(!err){
-
-									boost::asio::async_write(*ptr->socket_, ptr->request_,[ptr,f](const boost::system::error_code& err, std::size_t sz){
-										if(!err){
-											auto sptr = std::make_shared<jrb_stream_reader<SocketType>>(ptr->socket_,[ptr,f](request& req, response& res, const boost::system::error_code& ec)->bool{return false;});
-											sptr->handler_ = [ptr,f](request& req, response& res,const boost::system::error_code& ec)->bool{
-												f(ptr->uri_,req,ec);
-												return false;
-											};
-											sptr->start();
-										}
-										else{
-											client_response res;
-											f(ptr->uri_,res,err);
-										}
-									}); //async write
+									ptr->send_request(f);
 								}
 								else{
-									client_response res;
-									f(ptr->uri_,res,err);
+									ptr->fail(f,err);
 								}
 
 							}); // async_do_client_handshake
@@ -402,48 +2600,95 @@ const std::string method_names[] = 	{	// HTTP Method names
 						}
 						else
 						{
-							client_response res;
-							f(ptr->uri_,res,err);
+							ptr->fail(f,err);
 						}
 					}); // async connect
 
 				}
 				else
 				{
-					client_response res;
-					f(ptr->uri_,res,err);
+					ptr->fail(f,err);
 				}
 			}); // async resolve
 
 		}
 
+		void send_request(handler_func f){
+			auto ptr =  this->shared_from_this();
+			boost::asio::async_write(*socket_, boost::asio::buffer(request_),[ptr,f](const boost::system::error_code& err, std::size_t sz){
+				if(!err){
+					auto sptr = std::make_shared<jrb_stream_reader<SocketType>>(ptr->socket_,[](request&, response&, const boost::system::error_code&)->bool{return false;});
+					jrb_stream_reader<SocketType>* reader = sptr.get();
+					reader->single_message_ = true;
+					reader->decode_body_ = !ptr->raw_body_;
+					reader->max_decoded_body_ = ptr->max_decoded_;
+					reader->handler_ = [ptr,f,reader](request& req, response&,const boost::system::error_code& ec)->bool{
+						if(!ec){
+							// the reader is still in its read handler, so the socket only goes back to
+							// the pool once that has returned
+							bool keep_alive = reader->keep_alive_;
+							client_response res(req);
+							reader->strand_.post([ptr,f,res,keep_alive](){
+								ptr->pool_.release(ptr->pool_key_,ptr->socket_,keep_alive);
+								f(ptr->uri_,res,boost::system::error_code());
+							});
+						}
+						else if(ptr->reused_ && ptr->idempotent_ && reader->total_bytes_ == 0){
+							// the pooled connection had been closed by the server
+							ptr->retry(f);
+						}
+						else{
+							ptr->fail(f,ec);
+						}
+						return false;
+					};
+					sptr->start();
+				}
+				else if(ptr->reused_ && ptr->idempotent_){
+					ptr->retry(f);
+				}
+				else{
+					ptr->fail(f,err);
+				}
+			}); //async write
+		}
+
+		// Replaces a stale pooled connection with a new one, keeping its place in the pool
+		void retry(handler_func f){
+			boost::system::error_code ec;
+			socket_->lowest_layer().close(ec);
+			connect(f);
+		}
+
 	};
 
+	void async_http_client::set_max_connections_per_host(boost::asio::io_service& io, std::size_t n){
+		boost::asio::use_service<client_pool_service<boost::asio::ip::tcp::socket>>(io).max_per_host(n);
 #ifdef JRB_NODE_SSL
-	namespace{
-		struct jrb_client_default_context{
-			boost::asio::ssl::context context_;
-
-			jrb_client_default_context():context_(boost::asio::ssl::context::sslv23){
-				context_.set_default_verify_paths();
-			}
+		boost::asio::use_service<client_pool_service<boost::asio::ssl::stream<boost::asio::ip::tcp::socket>>>(io).max_per_host(n);
+#endif
+	}
 
-			static jrb_client_default_context& get_default(){
-				static jrb_client_default_context def;
-				return def;
-			}
-		};
+	void async_http_client::set_idle_timeout(boost::asio::io_service& io, long milliseconds){
+		boost::asio::use_service<client_pool_service<boost::asio::ip::tcp::socket>>(io).idle_timeout(milliseconds);
+#ifdef JRB_NODE_SSL
+		boost::asio::use_service<client_pool_service<boost::asio::ssl::stream<boost::asio::ip::tcp::socket>>>(io).idle_timeout(milliseconds);
+#endif
+	}
 
+	void async_http_client::set_dns_ttl(boost::asio::io_service& io, long ttl_seconds, long negative_ttl_seconds){
+		boost::asio::use_service<resolver_cache_service>(io).ttl(std::chrono::seconds(ttl_seconds),std::chrono::seconds(negative_ttl_seconds));
 	}
-#endif
+
 	// async_http_client
-	async_http_client::async_http_client(const uri& u, boost::asio::io_service& io):uri_(u),io_(&io){}
+	async_http_client::async_http_client(const uri& u, boost::asio::io_service& io):uri_(u),io_(&io),raw_body_(false),compress_min_(0),max_decoded_(64 * 1024 * 1024){}
 	void async_http_client::get(handler_func f)const{
 #ifdef JRB_NODE_SSL
 		if(uri_.schema() == "https"){
 			typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_socket;
-			std::shared_ptr<ssl_socket> s(new ssl_socket(*io_,jrb_client_default_context::get_default().context_));
-			std::shared_ptr<async_http_client_holder<ssl_socket>> holder(new async_http_client_holder<ssl_socket>(uri_,*io_,s));
+			std::shared_ptr<async_http_client_holder<ssl_socket>> holder(new async_http_client_holder<ssl_socket>(uri_,*io_));
+			holder->raw_body_ = raw_body_;
+			holder->max_decoded_ = max_decoded_;
 			holder->get(f);
 			
 		}
@@ -451,6 +2696,8 @@ const std::string method_names[] = 	{	// HTTP Method names
 #endif
 		{
 			std::shared_ptr<async_http_client_holder<boost::asio::ip::tcp::socket>> holder(new async_http_client_holder<boost::asio::ip::tcp::socket>(uri_,*io_));
+			holder->raw_body_ = raw_body_;
+			holder->max_decoded_ = max_decoded_;
 			holder->get(f);
 
 		}
@@ -459,14 +2706,19 @@ const std::string method_names[] = 	{	// HTTP Method names
 #ifdef JRB_NODE_SSL
 		if(uri_.schema() == "https"){
 			typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_socket;
-			std::shared_ptr<ssl_socket> s(new ssl_socket(*io_,jrb_client_default_context::get_default().context_));
-			std::shared_ptr<async_http_client_holder<ssl_socket>> holder(new async_http_client_holder<ssl_socket>(uri_,*io_,s));
+			std::shared_ptr<async_http_client_holder<ssl_socket>> holder(new async_http_client_holder<ssl_socket>(uri_,*io_));
+			holder->raw_body_ = raw_body_;
+			holder->max_decoded_ = max_decoded_;
+			holder->compress_min_ = compress_min_;
 			holder->post(data,content_type,f);
 		}
 		else
 #endif
 		{
 			std::shared_ptr<async_http_client_holder<boost::asio::ip::tcp::socket>> holder(new async_http_client_holder<boost::asio::ip::tcp::socket>(uri_,*io_));
+			holder->raw_body_ = raw_body_;
+			holder->max_decoded_ = max_decoded_;
+			holder->compress_min_ = compress_min_;
 			holder->post(data,content_type,f);
 
 		}
@@ -474,44 +2726,87 @@ const std::string method_names[] = 	{	// HTTP Method names
 
 
 	void async_http_client::set_uri(const uri& u){uri_ = u;}
-	http_client::http_client(const uri& u):ptr_(new boost::asio::io_service),client_(u,*ptr_){
+	namespace{
+		// The io_service behind http_clients that are not given one
+		struct client_event_loop{
+			boost::asio::io_service io_;
+			std::unique_ptr<boost::asio::io_service::work> work_;
+			boost::thread_group threads_;
+			boost::mutex mutex_;
+			std::size_t thread_count_;
+
+			client_event_loop():thread_count_(2){}
+			~client_event_loop(){
+				work_.reset();
+				io_.stop();
+				threads_.join_all();
+			}
+
+			static client_event_loop& get_default(){
+				static client_event_loop def;
+				return def;
+			}
+
+			boost::asio::io_service& io(){
+				boost::mutex::scoped_lock lock(mutex_);
+				if(!work_){
+					work_.reset(new boost::asio::io_service::work(io_));
+					add_threads();
+				}
+				return io_;
+			}
+
+			void threads(std::size_t n){
+				boost::mutex::scoped_lock lock(mutex_);
+				thread_count_ = n ? n : 1;
+				if(work_){
+					add_threads();
+				}
+			}
+
+		private:
+			void add_threads(){
+				while(threads_.size() < thread_count_){
+					threads_.create_thread([this](){io_.run();});
+				}
+			}
+		};
+
+		typedef boost::promise<std::pair<client_response,boost::system::error_code>> client_promise;
+
+		client_response check_response(const std::pair<client_response,boost::system::error_code>& r){
+			if(r.second){
+				throw boost::system::system_error(r.second);
+			}
+			return r.first;
+		}
+	}
+
+	http_client::http_client(const uri& u):client_(u,client_event_loop::get_default().io()){
 
+	}
+	void http_client::set_event_loop_threads(std::size_t n){
+		client_event_loop::get_default().threads(n);
+	}
+	boost::asio::io_service& http_client::event_loop(){
+		return client_event_loop::get_default().io();
 	}
 	client_response http_client::get(){
-		boost::promise<std::pair<client_response,boost::system::error_code>> p;
-		auto f = p.get_future();
-		client_.get([&p](const uri& u,const client_response& r, const boost::system::error_code& err)mutable{
-			p.set_value(std::make_pair(r,err));
+		auto p = std::make_shared<client_promise>();
+		auto f = p->get_future();
+		client_.get([p](const uri&,const client_response& r, const boost::system::error_code& err){
+			p->set_value(std::make_pair(r,err));
 		});
-		boost::thread t;
-		if(ptr_){
-			t = std::move(boost::thread([this](){ptr_->run();}));
-		}
-		auto r = f.get();
-		t.join();
-		if(r.second){
-			throw boost::system::system_error(r.second);
-		}
-		return r.first;
+		return check_response(f.get());
 	}
 
 	client_response http_client::post(const std::string& data,const std::string& content_type){
-		boost::promise<std::pair<client_response,boost::system::error_code>> p;
-		auto f = p.get_future();
-		client_.post(data,content_type,[&p](const uri& u,const client_response& r, const boost::system::error_code& err)mutable{
-			p.set_value(std::make_pair(r,err));
+		auto p = std::make_shared<client_promise>();
+		auto f = p->get_future();
+		client_.post(data,content_type,[p](const uri&,const client_response& r, const boost::system::error_code& err){
+			p->set_value(std::make_pair(r,err));
 		});
-
-		boost::thread t;
-		if(ptr_){
-			t = std::move(boost::thread([this](){ptr_->run();}));
-		}
-		auto r = f.get();
-		t.join();
-		if(r.second){
-			throw boost::system::system_error(r.second);
-		}
-		return r.first;
+		return check_response(f.get());
 	}
 
 	
@@ -520,147 +2815,806 @@ const std::string method_names[] = 	{	// HTTP Method names
 
 
 
-	namespace{
-		void set_if_present(http_parser_url& url, std::string& component,http_parser_url_fields field, const std::string& str){
-			if(url.field_set & 1 << field){
-				component = str.substr(url.field_data[field].off,url.field_data[field].len);
-			}
-		}
-
-	}
-
-	void uri::set_uri_string(const std::string& str){
+	void uri::set_uri_string(const string_ref& str){
 		http_parser_url url;
 		if(http_parser_parse_url(str.data(),str.size(),0,&url)){
 			// error parsing
 			throw std::runtime_error("Invalid url");
 		}
-		set_if_present(url,schema_,UF_SCHEMA,str);
-		set_if_present(url,host_,UF_HOST,str);
-		set_if_present(url,port_,UF_PORT,str);
-		set_if_present(url,path_,UF_PATH,str);
-		set_if_present(url,query_,UF_QUERY,str);
-		set_if_present(url,fragment_,UF_FRAGMENT,str);
+		string_ref parts[part_count];
+		for(int i = 0; i < part_count; ++i){
+			if(url.field_set & 1 << i){
+				parts[i] = string_ref(str.data() + url.field_data[i].off,url.field_data[i].len);
+			}
+		}
+		assemble(parts);
+		port_ = url.field_set & 1 << UF_PORT ? url.port : 0;
+	}
 
+	void uri::port(int p){set_part(port_part,boost::lexical_cast<std::string>(p));}
 
+	void uri::set_part(part_type p, const string_ref& str){
+		string_ref parts[part_count];
+		for(int i = 0; i < part_count; ++i){
+			parts[i] = part(static_cast<part_type>(i));
+		}
+		parts[p] = str;
+		assemble(parts);
 	}
 
-	bool uri::valid(){
-		std::string str = get_uri_string();
-		http_parser_url url;
-
-		if(http_parser_parse_url(str.data(),str.size(),0,&url)){
-			return false;
+	void uri::assemble(const string_ref* parts){
+		static_assert(static_cast<int>(schema_part) == static_cast<int>(UF_SCHEMA) && static_cast<int>(fragment_part) == static_cast<int>(UF_FRAGMENT),"uri parts follow http_parser_url_fields");
+		static const char* const separators[part_count] = {"","://",":","","?","#"};
+		// two more for the brackets of an IPv6 host
+		std::size_t size = 5;
+		for(int i = 0; parts && i < part_count; ++i){
+			size += parts[i].size() + 1;
 		}
-		else{
-			return true;
+		// http_parser and parts_ use 16 bit offsets
+		if(size > 0xffff) throw std::runtime_error("Invalid uri");
+		std::string text;
+		text.reserve(size);
+		part_range ranges[part_count];
+		for(int i = 0; i < part_count; ++i){
+			string_ref p = parts ? parts[i] : string_ref();
+			if(i == host_part || p.size()) text += separators[i];
+			// the host part of an IPv6 address leaves out its brackets
+			bool bracket = i == host_part && std::find(p.begin(),p.end(),':') != p.end();
+			if(bracket) text += '[';
+			ranges[i].offset = static_cast<std::uint16_t>(text.size());
+			ranges[i].length = static_cast<std::uint16_t>(p.size());
+			if(p.size()) text.append(p.data(),p.size());
+			if(bracket) text += ']';
 		}
+		text_.swap(text);
+		std::copy(ranges,ranges + part_count,parts_);
 
+		http_parser_url url;
+		valid_ = !http_parser_parse_url(text_.data(),text_.size(),0,&url);
+		port_ = valid_ && (url.field_set & 1 << UF_PORT) ? url.port : 0;
 	}
 
 
 	namespace status_strings {
 
-		const std::string ok =
-			"HTTP/1.0 200 OK\r\n";
-		const std::string created =
-			"HTTP/1.0 201 Created\r\n";
-		const std::string accepted =
-			"HTTP/1.0 202 Accepted\r\n";
-		const std::string no_content =
-			"HTTP/1.0 204 No Content\r\n";
-		const std::string multiple_choices =
-			"HTTP/1.0 300 Multiple Choices\r\n";
-		const std::string moved_permanently =
-			"HTTP/1.0 301 Moved Permanently\r\n";
-		const std::string moved_temporarily =
-			"HTTP/1.0 302 Moved Temporarily\r\n";
-		const std::string not_modified =
-			"HTTP/1.0 304 Not Modified\r\n";
-		const std::string bad_request =
-			"HTTP/1.0 400 Bad Request\r\n";
-		const std::string unauthorized =
-			"HTTP/1.0 401 Unauthorized\r\n";
-		const std::string forbidden =
-			"HTTP/1.0 403 Forbidden\r\n";
-		const std::string not_found =
-			"HTTP/1.0 404 Not Found\r\n";
-		const std::string internal_server_error =
-			"HTTP/1.0 500 Internal Server Error\r\n";
-		const std::string not_implemented =
-			"HTTP/1.0 501 Not Implemented\r\n";
-		const std::string bad_gateway =
-			"HTTP/1.0 502 Bad Gateway\r\n";
-		const std::string service_unavailable =
-			"HTTP/1.0 503 Service Unavailable\r\n";
+		struct status_line{
+			int code;
+			const char* text;
+			std::size_t size;
+		};
+		bool operator<(const status_line& a, int code){return a.code < code;}
+
+#define JRB_NODE_STATUS_LINE(code, reason) {code,"HTTP/1.1 " #code " " reason "\r\n",sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1}
+		// sorted by code
+		const status_line lines[] = {
+			JRB_NODE_STATUS_LINE(100,"Continue"),
+			JRB_NODE_STATUS_LINE(101,"Switching Protocols"),
+			JRB_NODE_STATUS_LINE(102,"Processing"),
+			JRB_NODE_STATUS_LINE(103,"Early Hints"),
+			JRB_NODE_STATUS_LINE(200,"OK"),
+			JRB_NODE_STATUS_LINE(201,"Created"),
+			JRB_NODE_STATUS_LINE(202,"Accepted"),
+			JRB_NODE_STATUS_LINE(203,"Non-Authoritative Information"),
+			JRB_NODE_STATUS_LINE(204,"No Content"),
+			JRB_NODE_STATUS_LINE(205,"Reset Content"),
+			JRB_NODE_STATUS_LINE(206,"Partial Content"),
+			JRB_NODE_STATUS_LINE(207,"Multi-Status"),
+			JRB_NODE_STATUS_LINE(208,"Already Reported"),
+			JRB_NODE_STATUS_LINE(226,"IM Used"),
+			JRB_NODE_STATUS_LINE(300,"Multiple Choices"),
+			JRB_NODE_STATUS_LINE(301,"Moved Permanently"),
+			JRB_NODE_STATUS_LINE(302,"Moved Temporarily"),
+			JRB_NODE_STATUS_LINE(303,"See Other"),
+			JRB_NODE_STATUS_LINE(304,"Not Modified"),
+			JRB_NODE_STATUS_LINE(305,"Use Proxy"),
+			JRB_NODE_STATUS_LINE(307,"Temporary Redirect"),
+			JRB_NODE_STATUS_LINE(308,"Permanent Redirect"),
+			JRB_NODE_STATUS_LINE(400,"Bad Request"),
+			JRB_NODE_STATUS_LINE(401,"Unauthorized"),
+			JRB_NODE_STATUS_LINE(402,"Payment Required"),
+			JRB_NODE_STATUS_LINE(403,"Forbidden"),
+			JRB_NODE_STATUS_LINE(404,"Not Found"),
+			JRB_NODE_STATUS_LINE(405,"Method Not Allowed"),
+			JRB_NODE_STATUS_LINE(406,"Not Acceptable"),
+			JRB_NODE_STATUS_LINE(407,"Proxy Authentication Required"),
+			JRB_NODE_STATUS_LINE(408,"Request Timeout"),
+			JRB_NODE_STATUS_LINE(409,"Conflict"),
+			JRB_NODE_STATUS_LINE(410,"Gone"),
+			JRB_NODE_STATUS_LINE(411,"Length Required"),
+			JRB_NODE_STATUS_LINE(412,"Precondition Failed"),
+			JRB_NODE_STATUS_LINE(413,"Payload Too Large"),
+			JRB_NODE_STATUS_LINE(414,"URI Too Long"),
+			JRB_NODE_STATUS_LINE(415,"Unsupported Media Type"),
+			JRB_NODE_STATUS_LINE(416,"Range Not Satisfiable"),
+			JRB_NODE_STATUS_LINE(417,"Expectation Failed"),
+			JRB_NODE_STATUS_LINE(421,"Misdirected Request"),
+			JRB_NODE_STATUS_LINE(422,"Unprocessable Entity"),
+			JRB_NODE_STATUS_LINE(423,"Locked"),
+			JRB_NODE_STATUS_LINE(424,"Failed Dependency"),
+			JRB_NODE_STATUS_LINE(425,"Too Early"),
+			JRB_NODE_STATUS_LINE(426,"Upgrade Required"),
+			JRB_NODE_STATUS_LINE(428,"Precondition Required"),
+			JRB_NODE_STATUS_LINE(429,"Too Many Requests"),
+			JRB_NODE_STATUS_LINE(431,"Request Header Fields Too Large"),
+			JRB_NODE_STATUS_LINE(451,"Unavailable For Legal Reasons"),
+			JRB_NODE_STATUS_LINE(500,"Internal Server Error"),
+			JRB_NODE_STATUS_LINE(501,"Not Implemented"),
+			JRB_NODE_STATUS_LINE(502,"Bad Gateway"),
+			JRB_NODE_STATUS_LINE(503,"Service Unavailable"),
+			JRB_NODE_STATUS_LINE(504,"Gateway Timeout"),
+			JRB_NODE_STATUS_LINE(505,"HTTP Version Not Supported"),
+			JRB_NODE_STATUS_LINE(506,"Variant Also Negotiates"),
+			JRB_NODE_STATUS_LINE(507,"Insufficient Storage"),
+			JRB_NODE_STATUS_LINE(508,"Loop Detected"),
+			JRB_NODE_STATUS_LINE(510,"Not Extended"),
+			JRB_NODE_STATUS_LINE(511,"Network Authentication Required")
+		};
+#undef JRB_NODE_STATUS_LINE
+
+		const status_line& internal_server_error = *std::lower_bound(std::begin(lines),std::end(lines),500);
 
 	}
 	namespace misc_strings {
 
-		const std::string name_value_separator = ": ";
-		const std::string crlf = "\r\n";
+		const char name_value_separator[] = ": ";
+		const char crlf[] = "\r\n";
 
 
 	} // namespace misc_strings
 
-	std::string response::get_as_http()
+	// response compression
+	namespace{
+		enum content_coding{coding_identity, coding_gzip, coding_deflate};
+
+		// The q values accept gives gzip and deflate, 0 if they are not acceptable
+		void coding_qualities(const string_ref& accept, double& gzip, double& deflate){
+			gzip = -1;
+			deflate = -1;
+			double any = -1;
+			const char* p = accept.data();
+			const char* e = p + accept.size();
+			while(p != e){
+				const char* end = std::find(p,e,',');
+				const char* semi = std::find(p,end,';');
+				const char* b = p;
+				while(b != semi && (*b == ' ' || *b == '\t')) ++b;
+				const char* n = semi;
+				while(n != b && (n[-1] == ' ' || n[-1] == '\t')) --n;
+				double q = 1;
+				const char* qp = semi;
+				while(qp != end && (*qp == ';' || *qp == ' ' || *qp == '\t')) ++qp;
+				if(end - qp >= 2 && (*qp == 'q' || *qp == 'Q') && qp[1] == '='){
+					q = std::atof(std::string(qp + 2,end).c_str());
+				}
+				string_ref name(b,n - b);
+				if(detail::ascii_iequals(name,"gzip") || detail::ascii_iequals(name,"x-gzip")) gzip = q;
+				else if(detail::ascii_iequals(name,"deflate")) deflate = q;
+				else if(name == string_ref("*")) any = q;
+				p = end == e ? e : end + 1;
+			}
+			if(gzip < 0) gzip = any < 0 ? 0 : any;
+			if(deflate < 0) deflate = any < 0 ? 0 : any;
+		}
+
+		// The coding of accept to use, gzip over deflate when they are rated the same
+		content_coding negotiate_coding(const string_ref& accept){
+			double gzip, deflate;
+			coding_qualities(accept,gzip,deflate);
+			if(gzip > 0 && gzip >= deflate) return coding_gzip;
+			if(deflate > 0) return coding_deflate;
+			return coding_identity;
+		}
+
+		// Types that are compressed already, or not worth compressing
+		bool compressible_type(const std::string& type){
+			static const char* const skip[] = {
+				"image/png","image/jpeg","image/gif","image/webp","image/x-icon","audio/","video/",
+				"font/woff","application/zip","application/gzip","application/pdf","application/octet-stream"
+			};
+			for(auto s:skip){
+				std::size_t n = std::strlen(s);
+				if(type.size() >= n && detail::ascii_iequals(string_ref(type.data(),n),s)) return false;
+			}
+			return true;
+		}
+
+		std::uint64_t thread_cpu_microseconds(){
+#ifndef _WIN32
+			timespec ts;
+			if(clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts) != 0) return 0;
+			return static_cast<std::uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#else
+			FILETIME c, e, k, u;
+			if(!GetThreadTimes(GetCurrentThread(),&c,&e,&k,&u)) return 0;
+			std::uint64_t t = ((static_cast<std::uint64_t>(k.dwHighDateTime) << 32) | k.dwLowDateTime)
+				+ ((static_cast<std::uint64_t>(u.dwHighDateTime) << 32) | u.dwLowDateTime);
+			return t / 10;
+#endif
+		}
+
+		struct compression_totals{
+			std::atomic<std::uint64_t> responses;
+			std::atomic<std::uint64_t> bytes_in;
+			std::atomic<std::uint64_t> bytes_out;
+			std::atomic<std::uint64_t> cpu_microseconds;
+			// replaced under the mutex, and called on a copy so it can change while in use
+			boost::mutex observer_mutex;
+			std::shared_ptr<std::function<void(const compression_stats&)>> observer;
+		};
+
+		compression_totals& get_compression_totals(){
+			static compression_totals totals;
+			return totals;
+		}
+
+		// Appends n bytes of data to chunk with chunk framing
+		void frame_chunk(const char* data, std::size_t n, std::string& chunk){
+			char size[sizeof(std::size_t) * 2];
+			std::size_t i = sizeof(size);
+			std::size_t left = n;
+			do{
+				size[--i] = "0123456789abcdef"[left & 0xf];
+				left >>= 4;
+			}while(left);
+			chunk.reserve(chunk.size() + sizeof(size) - i + n + 2 * (sizeof(misc_strings::crlf) - 1));
+			chunk.append(size + i,sizeof(size) - i);
+			chunk += misc_strings::crlf;
+			chunk.append(data,n);
+			chunk += misc_strings::crlf;
+		}
+	}
+
+	struct compression_state{
+		content_coding coding_;
+		int level_;
+		std::size_t min_size_;
+		// the body is being compressed, and the stream is set up
+		bool active_;
+		bool applied_;
+		z_stream stream_;
+		compression_stats stats_;
+
+		compression_state(content_coding c, int level, std::size_t min_size)
+			:coding_(c),level_(level),min_size_(min_size),active_(false),applied_(false){}
+		~compression_state(){
+			if(active_) deflateEnd(&stream_);
+		}
+
+		bool start(){
+			std::memset(&stream_,0,sizeof(stream_));
+			int bits = coding_ == coding_gzip ? 15 + 16 : 15;
+			int level = level_ < 1 ? 1 : level_ > 9 ? 9 : level_;
+			active_ = deflateInit2(&stream_,level,Z_DEFLATED,bits,8,Z_DEFAULT_STRATEGY) == Z_OK;
+			return active_;
+		}
+
+		// Compresses n bytes of data onto the end of out. flush is Z_SYNC_FLUSH for a chunk,
+		// which makes everything so far decodable, or Z_FINISH for the end of the body
+		void run(const char* data, std::size_t n, int flush, std::string& out){
+			std::uint64_t cpu = thread_cpu_microseconds();
+			std::size_t start = out.size();
+			stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+			stream_.avail_in = static_cast<uInt>(n);
+			int ret = Z_OK;
+			do{
+				std::size_t used = out.size();
+				out.resize(used + deflateBound(&stream_,stream_.avail_in) + 16);
+				stream_.next_out = reinterpret_cast<Bytef*>(&out[used]);
+				stream_.avail_out = static_cast<uInt>(out.size() - used);
+				ret = deflate(&stream_,flush);
+				out.resize(out.size() - stream_.avail_out);
+			}while(ret == Z_OK && (stream_.avail_in || stream_.avail_out == 0));
+			std::uint64_t spent = thread_cpu_microseconds() - cpu;
+			stats_.bytes_in += n;
+			stats_.bytes_out += out.size() - start;
+			stats_.cpu_microseconds += spent;
+			compression_totals& totals = get_compression_totals();
+			totals.bytes_in += n;
+			totals.bytes_out += out.size() - start;
+			totals.cpu_microseconds += spent;
+		}
+
+		void finish(){
+			deflateEnd(&stream_);
+			active_ = false;
+			stats_.responses = 1;
+			compression_totals& totals = get_compression_totals();
+			++totals.responses;
+			std::shared_ptr<std::function<void(const compression_stats&)>> observer;
+			{
+				boost::mutex::scoped_lock lock(totals.observer_mutex);
+				observer = totals.observer;
+			}
+			if(observer) (*observer)(stats_);
+		}
+	};
+
+	void response::compress(const request& req, int level, std::size_t min_size)
+	{
+		compression_ = std::make_shared<compression_state>(negotiate_coding(req.header("Accept-Encoding")),level,min_size);
+	}
+
+	compression_stats response::compression()const
+	{
+		return compression_ ? compression_->stats_ : compression_stats();
+	}
+
+	compression_stats response::total_compression()
 	{
+		compression_totals& totals = get_compression_totals();
+		compression_stats s;
+		s.responses = totals.responses;
+		s.bytes_in = totals.bytes_in;
+		s.bytes_out = totals.bytes_out;
+		s.cpu_microseconds = totals.cpu_microseconds;
+		return s;
+	}
+
+	void response::set_compression_observer(std::function<void(const compression_stats&)> f)
+	{
+		compression_totals& totals = get_compression_totals();
+		std::shared_ptr<std::function<void(const compression_stats&)>> observer;
+		if(f) observer = std::make_shared<std::function<void(const compression_stats&)>>(f);
+		boost::mutex::scoped_lock lock(totals.observer_mutex);
+		totals.observer.swap(observer);
+	}
+
+	void response::apply_compression()
+	{
+		if(!compression_ || compression_->applied_) return;
+		compression_state& c = *compression_;
+		c.applied_ = true;
+		// the body depends on Accept-Encoding even when it is not compressed
+		auto vary = message_.headers().find("Vary");
+		if(vary == message_.headers().end()){
+			message_["Vary"] = "Accept-Encoding";
+		}
+		else if(!boost::algorithm::icontains(vary->second,"Accept-Encoding")){
+			vary->second += ", Accept-Encoding";
+		}
+		if(c.coding_ == coding_identity || file_ || status_.status_ == status_t::no_content
+			|| status_.status_ == status_t::not_modified || status_.status_ == status_t::partial_content
+			|| message_.headers().count(http_headers::content_encoding) || !compressible_type(content_type())){
+			return;
+		}
+		if(!chunked_ && message_.body().size() < c.min_size_) return;
+		if(!c.start()) return;
+		message_[http_headers::content_encoding] = c.coding_ == coding_gzip ? "gzip" : "deflate";
+		if(chunked_) return;
+		std::string out;
+		c.run(message_.body().data(),message_.body().size(),Z_FINISH,out);
+		message_.swap_body(out);
+		c.finish();
+	}
+
+	void response::render_headers(std::string& head)
+	{
+		apply_compression();
 		add_required_headers();
-		std::vector<std::string> buffers;
-		buffers.push_back(status_.get_status_http_string());
-		for(auto p: message_.headers())
+		std::size_t size = 2;
+		for(const auto& p: message_.headers())
 		{
-			buffers.push_back((p.first));
-			buffers.push_back((misc_strings::name_value_separator));
-			buffers.push_back((p.second));
-			buffers.push_back((misc_strings::crlf));
+			size += p.first.size() + 2 + p.second.size() + 2;
 		}
-		buffers.push_back((misc_strings::crlf));
-		buffers.push_back((message_.body()));
-		return boost::algorithm::join(buffers,"");
+		head.clear();
+		head.reserve(size);
+		for(const auto& p: message_.headers())
+		{
+			head += p.first;
+			head += misc_strings::name_value_separator;
+			head += p.second;
+			head += misc_strings::crlf;
+		}
+		head += misc_strings::crlf;
+	}
+
+	boost::asio::const_buffer response::release_http(std::string& head, std::string& body)
+	{
+		render_headers(head);
+		body.clear();
+		message_.swap_body(body);
+		return status_.to_buffer();
+	}
 
+	boost::asio::const_buffer response::release_http(std::string& head, std::string& body, std::shared_ptr<file_body>& file)
+	{
+		boost::asio::const_buffer status = release_http(head,body);
+		file.swap(file_);
+		file_.reset();
+		return status;
 	}
 
-	const std::string& status_t::get_status_http_string(status_t::status_type s)const{
+	void response::send_headers()
+	{
+		std::string first;
+		message_.swap_body(first);
+		chunked_ = true;
+		if(sender_func_) sender_func_(*this);
+		if(first.size()) write_chunk(first);
+	}
 
-		using namespace status_strings;
-		switch (s)
-		{
-		case status_t::ok:
-			return status_strings::ok;
-		case status_t::created:
-			return status_strings::created;
-		case status_t::accepted:
-			return status_strings::accepted;
-		case status_t::no_content:
-			return status_strings::no_content;
-		case status_t::multiple_choices:
-			return status_strings::multiple_choices;
-		case status_t::moved_permanently:
-			return status_strings::moved_permanently;
-		case status_t::moved_temporarily:
-			return status_strings::moved_temporarily;
-		case status_t::not_modified:
-			return status_strings::not_modified;
-		case status_t::bad_request:
-			return status_strings::bad_request;
-		case status_t::unauthorized:
-			return status_strings::unauthorized;
-		case status_t::forbidden:
-			return status_strings::forbidden;
-		case status_t::not_found:
-			return status_strings::not_found;
-		case status_t::internal_server_error:
-			return status_strings::internal_server_error;
-		case status_t::not_implemented:
-			return status_strings::not_implemented;
-		case status_t::bad_gateway:
-			return status_strings::bad_gateway;
-		case status_t::service_unavailable:
-			return status_strings::service_unavailable;
-		default:
-			return status_strings::internal_server_error;
+	void response::write_chunk(const std::string& data, write_func done)
+	{
+		if(!chunk_sender_func_) return;
+		if(data.empty()){
+			// an empty chunk would end the body
+			if(done) done(boost::system::error_code());
+			return;
+		}
+		std::string chunk;
+		if(compression_ && compression_->active_){
+			std::string compressed;
+			compression_->run(data.data(),data.size(),Z_SYNC_FLUSH,compressed);
+			if(chunk_framing_){
+				frame_chunk(compressed.data(),compressed.size(),chunk);
+			}
+			else{
+				chunk.swap(compressed);
+			}
+		}
+		else if(chunk_framing_){
+			frame_chunk(data.data(),data.size(),chunk);
+		}
+		else{
+			chunk = data;
+		}
+		chunk_sender_func_(chunk,false,done);
+	}
+
+	void response::end_chunks(const http_headers& trailers, write_func done)
+	{
+		if(!chunk_sender_func_) return;
+		std::string chunk;
+		if(compression_ && compression_->active_){
+			std::string rest;
+			compression_->run(nullptr,0,Z_FINISH,rest);
+			compression_->finish();
+			if(chunk_framing_){
+				if(rest.size()) frame_chunk(rest.data(),rest.size(),chunk);
+			}
+			else{
+				chunk.swap(rest);
+			}
+		}
+		if(chunk_framing_){
+			chunk += "0";
+			chunk += misc_strings::crlf;
+			for(const auto& p:trailers){
+				chunk += p.first;
+				chunk += misc_strings::name_value_separator;
+				chunk += p.second;
+				chunk += misc_strings::crlf;
+			}
+			chunk += misc_strings::crlf;
+		}
+		auto f = chunk_sender_func_;
+		chunk_sender_func_ = nullptr;
+		f(chunk,true,done);
+	}
+
+	// static_file_handler
+	namespace{
+		bool stat_file(const std::string& path, std::uint64_t& size, std::time_t& mtime){
+#ifndef _WIN32
+			struct stat st;
+			if(::stat(path.c_str(),&st) != 0 || !S_ISREG(st.st_mode)) return false;
+#else
+			struct _stat64 st;
+			if(::_stat64(path.c_str(),&st) != 0 || !(st.st_mode & _S_IFREG)) return false;
+#endif
+			size = st.st_size;
+			mtime = st.st_mtime;
+			return true;
+		}
+	}
+
+	struct static_file_cache{
+		struct entry{
+			std::shared_ptr<mapped_file> mapping_;
+			std::uint64_t size_;
+			std::time_t mtime_;
+			std::list<std::string>::iterator lru_;
+		};
+
+		std::string root_;
+		std::size_t max_file_size_;
+		std::size_t max_bytes_;
+		std::size_t bytes_;
+		boost::mutex mutex_;
+		std::unordered_map<std::string,entry> entries_;
+		// most recently used first
+		std::list<std::string> lru_;
+
+		// The mapping of path if it is still the file of that size and time. A hit is checked
+		// against the file once more under the lock, which narrows but cannot close the window
+		// in which a file truncated in place makes reading the mapping raise SIGBUS
+		std::shared_ptr<mapped_file> get(const std::string& path, std::uint64_t size, std::time_t mtime){
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				auto iter = entries_.find(path);
+				if(iter != entries_.end()){
+					std::uint64_t now_size = 0;
+					std::time_t now_mtime = 0;
+					if(iter->second.size_ == size && iter->second.mtime_ == mtime
+						&& stat_file(path,now_size,now_mtime) && now_size == size && now_mtime == mtime){
+						lru_.splice(lru_.begin(),lru_,iter->second.lru_);
+						return iter->second.mapping_;
+					}
+					remove(iter);
+				}
+			}
+			auto m = mapped_file::open(path);
+			if(!m || m->size_ != size) return nullptr;
+			boost::mutex::scoped_lock lock(mutex_);
+			auto iter = entries_.find(path);
+			if(iter != entries_.end()){
+				remove(iter);
+			}
+			lru_.push_front(path);
+			entry& e = entries_[path];
+			e.mapping_ = m;
+			e.size_ = size;
+			e.mtime_ = mtime;
+			e.lru_ = lru_.begin();
+			bytes_ += m->size_;
+			while(bytes_ > max_bytes_ && lru_.size() > 1){
+				remove(entries_.find(lru_.back()));
+			}
+			return m;
+		}
+
+		void remove(std::unordered_map<std::string,entry>::iterator iter){
+			bytes_ -= iter->second.mapping_->size_;
+			lru_.erase(iter->second.lru_);
+			entries_.erase(iter);
+		}
+	};
+
+	namespace{
+		const char* const http_months[] = {"Jan","Feb","Mar","Apr","May","Jun","Jul","Aug","Sep","Oct","Nov","Dec"};
+
+		std::string http_date(std::time_t t){
+			static const char* const days[] = {"Sun","Mon","Tue","Wed","Thu","Fri","Sat"};
+			std::tm tm;
+#ifndef _WIN32
+			gmtime_r(&t,&tm);
+#else
+			gmtime_s(&tm,&t);
+#endif
+			char buf[32];
+			std::sprintf(buf,"%s, %02d %s %04d %02d:%02d:%02d GMT",days[tm.tm_wday],tm.tm_mday,http_months[tm.tm_mon],tm.tm_year + 1900,tm.tm_hour,tm.tm_min,tm.tm_sec);
+			return buf;
+		}
+
+		// Days from 1970-01-01 to the date in the proleptic Gregorian calendar
+		long long days_from_civil(long long y, int m, int d){
+			y -= m <= 2;
+			long long era = (y >= 0 ? y : y - 399) / 400;
+			long long yoe = y - era * 400;
+			long long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+			long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+			return era * 146097 + doe - 719468;
+		}
+
+		// Parses the three date formats HTTP/1.1 accepts: "Sun, 06 Nov 1994 08:49:37 GMT",
+		// "Sunday, 06-Nov-94 08:49:37 GMT" and "Sun Nov  6 08:49:37 1994"
+		bool parse_http_date(const string_ref& text, std::time_t& t){
+			if(text.size() >= 64) return false;
+			std::string s(text.data(),text.size());
+			char month[4] = {0};
+			int day = 0, year = 0, hour = 0, minute = 0, second = 0;
+			std::size_t comma = s.find(',');
+			if(comma != std::string::npos){
+				const char* rest = s.c_str() + comma + 1;
+				if(std::sscanf(rest," %2d %3s %4d %2d:%2d:%2d GMT",&day,month,&year,&hour,&minute,&second) != 6){
+					if(std::sscanf(rest," %2d-%3[A-Za-z]-%2d %2d:%2d:%2d GMT",&day,month,&year,&hour,&minute,&second) != 6) return false;
+					year += year < 70 ? 2000 : 1900;
+				}
+			}
+			else if(std::sscanf(s.c_str(),"%*3s %3s %2d %2d:%2d:%2d %4d",month,&day,&hour,&minute,&second,&year) != 6){
+				return false;
+			}
+			int m = 0;
+			while(m < 12 && std::strcmp(month,http_months[m]) != 0) ++m;
+			if(m == 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60 || hour < 0 || minute < 0 || second < 0) return false;
+			t = static_cast<std::time_t>(((days_from_civil(year,m + 1,day) * 24 + hour) * 60 + minute) * 60 + second);
+			return true;
+		}
+
+		const char* content_type_for(const std::string& path){
+			static const char* const types[][2] = {
+				{".html","text/html"},{".htm","text/html"},{".css","text/css"},{".js","application/javascript"},
+				{".json","application/json"},{".txt","text/plain"},{".xml","application/xml"},{".svg","image/svg+xml"},
+				{".png","image/png"},{".jpg","image/jpeg"},{".jpeg","image/jpeg"},{".gif","image/gif"},
+				{".ico","image/x-icon"},{".webp","image/webp"},{".woff","font/woff"},{".woff2","font/woff2"},
+				{".wasm","application/wasm"},{".pdf","application/pdf"}
+			};
+			std::size_t dot = path.rfind('.');
+			if(dot != std::string::npos && path.find('/',dot) == std::string::npos){
+				for(auto& t:types){
+					if(detail::ascii_iequals(string_ref(path.data() + dot,path.size() - dot),t[0])) return t[1];
+				}
+			}
+			return "application/octet-stream";
+		}
+
+		// The file below root that the path of url names, false if it is malformed or tries to leave root
+		bool file_path(const std::string& root, const string_ref& url, std::string& path){
+			std::size_t end = 0;
+			while(end < url.size() && url.data()[end] != '?' && url.data()[end] != '#') ++end;
+			std::string decoded;
+			boost::system::error_code ec;
+			url_decode_append(url.data(),url.data() + end,decoded,ec);
+			if(ec) return false;
+			if(decoded.empty() || decoded[0] != '/') return false;
+			if(decoded.find('\0') != std::string::npos || decoded.find('\\') != std::string::npos) return false;
+			std::size_t pos = 0;
+			while(pos < decoded.size()){
+				std::size_t next = decoded.find('/',pos + 1);
+				if(next == std::string::npos) next = decoded.size();
+				if(decoded.compare(pos,next - pos,"/..") == 0) return false;
+				pos = next;
+			}
+			if(decoded[decoded.size() - 1] == '/') decoded += "index.html";
+			path = root + decoded;
+			return true;
+		}
+
+		// Parses a single range "bytes=first-last", "bytes=first-" or "bytes=-suffix" into
+		// [first,last]. Returns 0 for no usable range, -1 if it is outside size, 1 otherwise
+		int parse_range(const string_ref& r, std::uint64_t size, std::uint64_t& first, std::uint64_t& last){
+			static const char prefix[] = "bytes=";
+			if(r.size() <= sizeof(prefix) - 1 || !detail::ascii_iequals(string_ref(r.data(),sizeof(prefix) - 1),prefix)) return 0;
+			const char* p = r.data() + sizeof(prefix) - 1;
+			const char* e = r.data() + r.size();
+			if(std::find(p,e,',') != e) return 0;
+			std::uint64_t a = 0, b = 0;
+			bool has_a = false, has_b = false;
+			for(; p != e && *p >= '0' && *p <= '9'; ++p){ a = a * 10 + (*p - '0'); has_a = true;}
+			if(p == e || *p != '-') return 0;
+			for(++p; p != e && *p >= '0' && *p <= '9'; ++p){ b = b * 10 + (*p - '0'); has_b = true;}
+			if(p != e || (!has_a && !has_b)) return 0;
+			if(!has_a){
+				if(!b || !size) return -1;
+				first = b >= size ? 0 : size - b;
+				last = size - 1;
+				return 1;
+			}
+			if(a >= size || (has_b && b < a)) return -1;
+			first = a;
+			last = has_b && b < size ? b : size - 1;
+			return 1;
+		}
+	}
+
+	static_file_handler::static_file_handler(const std::string& root, std::size_t max_cached_file_size, std::size_t max_cache_bytes)
+		:cache_(std::make_shared<static_file_cache>())
+	{
+		cache_->root_ = root;
+		while(cache_->root_.size() && (cache_->root_[cache_->root_.size() - 1] == '/' || cache_->root_[cache_->root_.size() - 1] == '\\')){
+			cache_->root_.resize(cache_->root_.size() - 1);
+		}
+		cache_->max_file_size_ = max_cached_file_size;
+		cache_->max_bytes_ = max_cache_bytes;
+		cache_->bytes_ = 0;
+	}
+
+	bool static_file_handler::operator()(request& req, response& res){
+		const std::string& method = req.method();
+		bool head = method == "HEAD";
+		if(!head && method != "GET"){
+			res.status(status_t::not_implemented);
+			return true;
+		}
+		std::string path;
+		std::uint64_t size = 0;
+		std::time_t mtime = 0;
+		if(!file_path(cache_->root_,req.url_ref(),path)){
+			res.status(status_t::bad_request);
+			return true;
+		}
+		if(!stat_file(path,size,mtime)){
+			res.status(status_t::not_found);
+			return true;
+		}
+
+		res.content_type(content_type_for(path));
+		// a precompressed sibling that is not older than the file goes to clients that take gzip
+		std::uint64_t gz_size = 0;
+		std::time_t gz_mtime = 0;
+		std::time_t file_mtime = mtime;
+		if(stat_file(path + ".gz",gz_size,gz_mtime) && gz_mtime >= mtime){
+			res.message_["Vary"] = "Accept-Encoding";
+			double gzip, deflate;
+			coding_qualities(req.header("Accept-Encoding"),gzip,deflate);
+			if(gzip > 0){
+				path += ".gz";
+				size = gz_size;
+				file_mtime = gz_mtime;
+				res.message_[http_headers::content_encoding] = "gzip";
+			}
+		}
+
+		std::string last_modified = http_date(mtime);
+		res.message_["Last-Modified"] = last_modified;
+		res.message_["Accept-Ranges"] = "bytes";
+
+		std::uint64_t first = 0;
+		std::uint64_t length = size;
+		std::time_t since = 0;
+		if(parse_http_date(req.header("If-Modified-Since"),since) && mtime <= since){
+			// no body, but the Content-Length a 200 would have
+			res.status(status_t::not_modified);
+		}
+		else{
+			std::uint64_t last = 0;
+			int range = parse_range(req.header("Range"),size,first,last);
+			if(range < 0){
+				res.status(status_t::range_not_satisfiable);
+				res.message_["Content-Range"] = "bytes */" + boost::lexical_cast<std::string>(size);
+				return true;
+			}
+			if(range > 0){
+				res.status(status_t::partial_content);
+				res.message_["Content-Range"] = "bytes " + boost::lexical_cast<std::string>(first) + "-" + boost::lexical_cast<std::string>(last) + "/" + boost::lexical_cast<std::string>(size);
+				length = last - first + 1;
+			}
+		}
+
+		// the file went away between stat and open, so none of what was said about it holds
+		auto not_found = [&res]{
+			static const char* const file_headers[] = {"Content-Type","Content-Encoding","Vary","Last-Modified","Accept-Ranges","Content-Range"};
+			for(auto name : file_headers) res.message_.headers().erase(name);
+			res.file_length_ = 0;
+			res.status(status_t::not_found);
+		};
+		auto body = std::make_shared<file_body>();
+		res.file_length_ = length;
+		if(head || !length || res.status() == status_t::not_modified){
+			res.file_ = body;
+			return true;
+		}
+		if(size <= cache_->max_file_size_){
+			body->mapping_ = cache_->get(path,size,file_mtime);
+		}
+		if(body->mapping_){
+			body->data_ = body->mapping_->data_ + first;
+		}
+		else{
+#ifndef _WIN32
+			body->fd_ = ::open(path.c_str(),O_RDONLY | O_CLOEXEC);
+			if(body->fd_ < 0){
+				not_found();
+				return true;
+			}
+			body->offset_ = first;
+#else
+			body->mapping_ = mapped_file::open(path);
+			if(!body->mapping_ || body->mapping_->size_ < first + length){
+				not_found();
+				return true;
+			}
+			body->data_ = body->mapping_->data_ + first;
+#endif
 		}
+		body->length_ = length;
+		res.file_ = body;
+		return true;
+	}
+
+	std::string response::get_as_http()
+	{
+		std::string head;
+		render_headers(head);
+		return status_.get_status_http_string().to_string() + head + message_.body();
+
+	}
+
+	string_ref status_t::get_status_http_string(status_t::status_type s){
+		using status_strings::lines;
+		auto iter = std::lower_bound(std::begin(lines),std::end(lines),static_cast<int>(s));
+		const status_strings::status_line& line = iter != std::end(lines) && iter->code == s ? *iter : status_strings::internal_server_error;
+		return string_ref(line.text,line.size);
 	}
 
 }
@@ -11,8 +11,8 @@
 #ifndef JRB_NODE_NO_SSL
 #define JRB_NODE_SSL 
 #endif
-#include <map>
 #include <string>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/system/system_error.hpp>
 #include <boost/algorithm/string/predicate.hpp>
@@ -20,6 +20,7 @@
 #include <memory>
 #include <stdexcept>
 #include <utility>
+#include <cstdint>
 #include <boost/lexical_cast.hpp>
 #include "jrb_node_name_value.h"
 
@@ -29,79 +30,188 @@
 
 namespace jrb_node{
 
+	// A uri held as one buffer in the form schema://host:port/path?query#fragment, with the offset and
+	// length of each part into it, so copying one is a single allocation. The buffer is the
+	// serialized uri and is checked with http_parser when it is built
 	struct uri{
-		void schema(const std::string& str){schema_ = str;}
-		const std::string& schema()const {return schema_;}
+		enum part_type{schema_part,host_part,port_part,path_part,query_part,fragment_part,part_count};
 
-		void host(const std::string& str){host_ = str;}
-		const std::string& host()const {return host_;}
+		void schema(const string_ref& str){set_part(schema_part,str);}
+		string_ref schema()const{return part(schema_part);}
 
-		void port(const std::string& str){port_ = str;}
-		void port(int p){port_ = boost::lexical_cast<std::string>(p);}
-		const std::string& port(){return port_;}
+		// an IPv6 address without its brackets, which the uri string adds
+		void host(const string_ref& str){set_part(host_part,str);}
+		string_ref host()const{return part(host_part);}
 
-		void path(const std::string& str){ path_ = str;}
-		const std::string& path(){return path_;}
+		void port(const string_ref& str){set_part(port_part,str);}
+		void port(int p);
+		// 0 if the uri has no port
+		unsigned short port()const{return port_;}
 
-		void query(const std::string& str){ query_ = str;}
-		const std::string& query(){return query_;}
+		void path(const string_ref& str){set_part(path_part,str);}
+		string_ref path()const{return part(path_part);}
 
-		void fragment(const std::string& str){ fragment_ = str;}
-		const std::string& fragment(){return fragment_;}
+		void query(const string_ref& str){set_part(query_part,str);}
+		string_ref query()const{return part(query_part);}
 
-		std::string get_uri_string(){return schema_ + "://" + host_ + if_present(port_,":") + path_
-			+ if_present(query_,"?") + if_present(fragment_,"#");
+		void fragment(const string_ref& str){set_part(fragment_part,str);}
+		string_ref fragment()const{return part(fragment_part);}
 
+		const std::string& get_uri_string()const{return text_;}
+		// schema://host:port
+		string_ref origin()const{return string_ref(text_.data(),parts_[path_part].offset);}
+		// path?query, what goes in a request line
+		string_ref get_uri_client_request_string()const{
+			std::size_t end = parts_[query_part].length ? parts_[query_part].offset + parts_[query_part].length : parts_[path_part].offset + parts_[path_part].length;
+			return string_ref(text_.data() + parts_[path_part].offset,end - parts_[path_part].offset);
 		}
+		void set_uri_string(const string_ref& str);
 
-		std::string get_uri_client_request_string(){
-			return path_ + if_present(query_,"?");
-		}
-		void set_uri_string(const std::string& str);
-
-		bool valid();
+		bool valid()const{return valid_;}
 
-		void check_valid(){if(!valid()) throw std::runtime_error("Invalid uri");}
+		void check_valid()const{if(!valid()) throw std::runtime_error("Invalid uri");}
 
-		uri(){}
+		uri():port_(0),valid_(false){assemble(nullptr);}
 		uri(const std::string& str){set_uri_string(str);}
+		uri(const char* str){set_uri_string(str);}
 
 	private:
-		std::string schema_;
-		std::string host_;
-		std::string port_;
-		std::string path_;
-		std::string query_;
-		std::string fragment_;
-		static std::string if_present(const std::string& part,const std::string& sep){
-			if(part.size()){
-				return sep + part;
-			}else{
-				return std::string();
+		struct part_range{
+			std::uint16_t offset;
+			std::uint16_t length;
+		};
+		std::string text_;
+		part_range parts_[part_count];
+		unsigned short port_;
+		bool valid_;
+
+		string_ref part(part_type p)const{return string_ref(text_.data() + parts_[p].offset,parts_[p].length);}
+		void set_part(part_type p, const string_ref& str);
+		// rebuilds text_ and parts_ from parts, which may point into text_
+		void assemble(const string_ref* parts);
+	};
+
+	namespace detail{
+		inline char ascii_tolower(char c){
+			return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+		}
+		// case insensitive for ASCII letters only, which is what http header names use
+		inline bool ascii_iequals(const string_ref& a, const string_ref& b){
+			if(a.size() != b.size()) return false;
+			for(std::size_t i = 0; i < a.size(); ++i){
+				if(ascii_tolower(a[i]) != ascii_tolower(b[i])) return false;
 			}
+			return true;
+		}
+		// FNV-1a of the lower cased name
+		inline std::uint32_t ascii_ihash(const string_ref& s){
+			std::uint32_t h = 2166136261u;
+			for(char c:s){
+				h ^= static_cast<unsigned char>(ascii_tolower(c));
+				h *= 16777619u;
+			}
+			return h;
+		}
+	}
+
+	// Http headers kept in arrival order in a flat vector. Names compare case insensitively
+	// and each entry carries the hash of its name, so a lookup is a scan over a few integers
+	struct http_headers{
+		typedef std::pair<std::string,std::string> value_type;
+		typedef std::vector<value_type>::iterator iterator;
+		typedef std::vector<value_type>::const_iterator const_iterator;
+
+		// Headers the library itself looks up, their hashes are only computed once
+		enum known_header{
+			content_type,
+			content_length,
+			connection,
+			transfer_encoding,
+			content_encoding,
+			host,
+			known_header_count
+		};
+		static string_ref known_name(known_header k){
+			static const char* const names[] = {"Content-Type","Content-Length","Connection","Transfer-Encoding","Content-Encoding","Host"};
+			return names[k];
+		}
+
+		iterator begin(){return entries_.begin();}
+		iterator end(){return entries_.end();}
+		const_iterator begin()const{return entries_.begin();}
+		const_iterator end()const{return entries_.end();}
+		std::size_t size()const{return entries_.size();}
+		bool empty()const{return entries_.empty();}
+		void clear(){entries_.clear();hashes_.clear();}
+
+		iterator find(const string_ref& name){return begin() + index_of(name,detail::ascii_ihash(name));}
+		const_iterator find(const string_ref& name)const{return begin() + index_of(name,detail::ascii_ihash(name));}
+		iterator find(known_header k){return begin() + index_of(known_name(k),known_hash(k));}
+		const_iterator find(known_header k)const{return begin() + index_of(known_name(k),known_hash(k));}
+
+		std::size_t count(const string_ref& name)const{return find(name) == end() ? 0 : 1;}
+		std::size_t count(known_header k)const{return find(k) == end() ? 0 : 1;}
+
+		std::string& operator[](const string_ref& name){return get_or_add(name,detail::ascii_ihash(name));}
+		std::string& operator[](known_header k){return get_or_add(known_name(k),known_hash(k));}
+
+		iterator erase(iterator iter){
+			hashes_.erase(hashes_.begin() + (iter - begin()));
+			return entries_.erase(iter);
+		}
+		std::size_t erase(const string_ref& name){
+			auto iter = find(name);
+			if(iter == end()) return 0;
+			erase(iter);
+			return 1;
 		}
-	};
 
-	struct http_message{
 	private:
-		// from boost examples
-		struct iless
-		{
-			bool operator()(std::string const& x,
-				std::string const& y) const
-			{
-				return boost::algorithm::ilexicographical_compare(x, y, std::locale());
+		std::vector<value_type> entries_;
+		std::vector<std::uint32_t> hashes_;
+
+		// initialized once on first use, which C++11 makes safe from several threads
+		static std::uint32_t known_hash(known_header k){
+			static const std::uint32_t hashes[known_header_count] = {
+				detail::ascii_ihash(known_name(content_type)),
+				detail::ascii_ihash(known_name(content_length)),
+				detail::ascii_ihash(known_name(connection)),
+				detail::ascii_ihash(known_name(transfer_encoding)),
+				detail::ascii_ihash(known_name(content_encoding)),
+				detail::ascii_ihash(known_name(host))
+			};
+			return hashes[k];
+		}
+
+		std::size_t index_of(const string_ref& name, std::uint32_t h)const{
+			for(std::size_t i = 0; i < hashes_.size(); ++i){
+				if(hashes_[i] == h && detail::ascii_iequals(entries_[i].first,name)){
+					return i;
+				}
 			}
-		};
+			return entries_.size();
+		}
 
-	public:
-		typedef std::map<std::string,std::string,iless> map_type;
+		std::string& get_or_add(const string_ref& name, std::uint32_t h){
+			std::size_t i = index_of(name,h);
+			if(i == entries_.size()){
+				entries_.push_back(value_type(name.to_string(),std::string()));
+				hashes_.push_back(h);
+			}
+			return entries_[i].second;
+		}
+	};
 
-		std::string& operator[](const std::string& key){return headers_[key];}
+	struct http_message{
+		typedef http_headers map_type;
+
+		std::string& operator[](const string_ref& key){return headers_[key];}
+		std::string& operator[](http_headers::known_header k){return headers_[k];}
 
 		const std::string& body()const{return body_;}
 		void body(const std::string& b){ body_ =  b;}
 		void body_append(const std::string& b){ body_ +=  b;}
+		void swap_body(std::string& b){ body_.swap(b);}
 
 		const std::string& method()const {return method_;}
 		void method(const std::string& m) { method_ = m;}
@@ -122,32 +232,80 @@ namespace jrb_node{
 
 	};
 	struct status_t{
+		// The codes registered with IANA. A value outside them is sent as 500
 		enum status_type
 		{
+			continue_ = 100,
+			switching_protocols = 101,
+			processing = 102,
+			early_hints = 103,
 			ok = 200,
 			created = 201,
 			accepted = 202,
+			non_authoritative_information = 203,
 			no_content = 204,
+			reset_content = 205,
+			partial_content = 206,
+			multi_status = 207,
+			already_reported = 208,
+			im_used = 226,
 			multiple_choices = 300,
 			moved_permanently = 301,
 			moved_temporarily = 302,
+			see_other = 303,
 			not_modified = 304,
+			use_proxy = 305,
+			temporary_redirect = 307,
+			permanent_redirect = 308,
 			bad_request = 400,
 			unauthorized = 401,
+			payment_required = 402,
 			forbidden = 403,
 			not_found = 404,
+			method_not_allowed = 405,
+			not_acceptable = 406,
+			proxy_authentication_required = 407,
+			request_timeout = 408,
+			conflict = 409,
+			gone = 410,
+			length_required = 411,
+			precondition_failed = 412,
+			payload_too_large = 413,
+			uri_too_long = 414,
+			unsupported_media_type = 415,
+			range_not_satisfiable = 416,
+			expectation_failed = 417,
+			misdirected_request = 421,
+			unprocessable_entity = 422,
+			locked = 423,
+			failed_dependency = 424,
+			too_early = 425,
+			upgrade_required = 426,
+			precondition_required = 428,
+			too_many_requests = 429,
+			request_header_fields_too_large = 431,
+			unavailable_for_legal_reasons = 451,
 			internal_server_error = 500,
 			not_implemented = 501,
 			bad_gateway = 502,
-			service_unavailable = 503
+			service_unavailable = 503,
+			gateway_timeout = 504,
+			http_version_not_supported = 505,
+			variant_also_negotiates = 506,
+			insufficient_storage = 507,
+			loop_detected = 508,
+			not_extended = 510,
+			network_authentication_required = 511
 		} status_;
 		status_t():status_(ok){}
-		const std::string& get_status_http_string(status_type s)const;
-		const std::string& get_status_http_string()const {return get_status_http_string(status_);}
-
-
+		// The status line, CRLF included, which refers to a static array
+		static string_ref get_status_http_string(status_type s);
+		string_ref get_status_http_string()const {return get_status_http_string(status_);}
 
-		boost::asio::const_buffer to_buffer() const{return boost::asio::buffer(get_status_http_string(status_));}
+		boost::asio::const_buffer to_buffer() const{
+			string_ref line = get_status_http_string(status_);
+			return boost::asio::buffer(line.data(),line.size());
+		}
 
 	};
 
@@ -159,53 +317,100 @@ namespace jrb_node{
 	public:
 		request();
 		request(std::shared_ptr<jrb_parser_message>p);
+		typedef std::vector<std::pair<string_ref,string_ref>> header_refs_type;
+
 		const std::string& body()const;
 		int status_code()const;
 		const http_message::map_type& headers()const;
 		std::string content_type()const{
-			auto iter = headers().find("content-type");
-			if (iter == headers().end()){
-				return "";
-			}
-			else{
-				return iter->second;
-			}
+			return header(http_headers::content_type).to_string();
 		}
 		const std::string& method()const;
 
 		const std::string& url()const;
 
+		// References into the connection's read buffers, valid for the lifetime of this request.
+		// Unlike url(), body() and headers() these never copy the parsed data
+		string_ref url_ref()const;
+		string_ref body_ref()const;
+		const header_refs_type& header_refs()const;
+		// value of the first header named name (case insensitive), empty if there is none
+		string_ref header(const string_ref& name)const;
+		string_ref header(http_headers::known_header k)const{return header(http_headers::known_name(k));}
+
+		// The query of url(), still encoded, located without copying the url
+		string_ref query_ref()const;
+		// The decoded query parameters sorted by name, built on the first call and kept with the request.
+		// Parameters with an invalid escape are left out
+		typedef std::vector<std::pair<string_ref,string_ref>> query_refs_type;
+		const query_refs_type& query_params()const;
+		// value of the last parameter named name, empty if there is none
+		string_ref query_param(const string_ref& name)const;
+
 		template<class MapType>
 		void parse_name_value(MapType& m){
 			if(method() == "GET"){
-				uri u("http://localhost" + url());
-				jrb_node::parse_name_value(u.query(),m);
+				jrb_node::parse_name_value(query_ref(),m);
 			}
 			else{
-				jrb_node::parse_name_value(body(),m);
+				jrb_node::parse_name_value(body_ref(),m);
 			}
 		}
 	};
 
 	typedef request client_response;
 
+	struct file_body;
+
+	// What response::compress() did, for one response or all of them
+	struct compression_stats{
+		compression_stats():responses(0),bytes_in(0),bytes_out(0),cpu_microseconds(0){}
+		std::uint64_t responses;
+		std::uint64_t bytes_in;
+		std::uint64_t bytes_out;
+		// CPU time of the compressing threads spent in zlib
+		std::uint64_t cpu_microseconds;
+		// compressed size over original size, 1 if nothing was compressed
+		double ratio()const{return bytes_in ? static_cast<double>(bytes_out) / bytes_in : 1.0;}
+	};
+
+	struct compression_state;
+
 	struct response{
+	public:
+		typedef std::function<void (const boost::system::error_code&)> write_func;
+
 	protected:
 		http_message message_;
 		status_t status_;
 		std::function<void(response&)> sender_func_;
+		// takes a framed chunk, whether it is the last one and the function to call once it is written
+		std::function<void(std::string&, bool, write_func)> chunk_sender_func_;
+		bool keep_alive_;
+		bool chunked_;
+		// false for HTTP/1.0 requests, whose body is sent as is and ends with the connection
+		bool chunk_framing_;
+		// a body sent from a file instead of body(), and its Content-Length, which is more than
+		// is sent for a HEAD request
+		std::shared_ptr<file_body> file_;
+		std::uint64_t file_length_;
+		std::shared_ptr<compression_state> compression_;
+		friend class static_file_handler;
+
+		// Compresses a whole body, or starts compressing a chunked one, once headers are rendered
+		void apply_compression();
 
 	public:
-		response(){}
+		response():keep_alive_(false),chunked_(false),chunk_framing_(true),file_length_(0){}
 		void body(const std::string& s){ message_.body(s);}
 		const std::string& body()const{return message_.body();}
 
 		void content_type(const std::string & s){
-			message_["Content-Type"] = 	s;
+			message_[http_headers::content_type] = 	s;
 
 		}
 		std::string content_type()const{
-			auto iter = message_.headers().find("Content-Type");
+			auto iter = message_.headers().find(http_headers::content_type);
 			if(iter == message_.headers().end()){
 				return "";
 			}else{
@@ -216,27 +421,131 @@ namespace jrb_node{
 		status_t::status_type status()const{return status_.status_;}
 		void status(status_t::status_type t){status_.status_ = t;}
 
-		void send(){if(sender_func_)sender_func_(*this);}
+		// whether the connection stays open for another request after this response
+		bool keep_alive()const{return keep_alive_;}
+		void keep_alive(bool k){keep_alive_ = k;}
+
+		void send(){
+			if(chunked_){
+				end_chunks();
+			}
+			else if(sender_func_){
+				sender_func_(*this);
+			}
+		}
+
+		// A body written as it is produced, with Transfer-Encoding: chunked. send_headers() sends
+		// the status line, the headers and any body set so far. Each write_chunk() sends data as a
+		// chunk, and end_chunks() ends the body with optional trailers. done is called on the
+		// connection's io_service once that data has been written, or with the error that stopped it
+		void send_headers();
+		void write_chunk(const std::string& data, write_func done = write_func());
+		void end_chunks(const http_headers& trailers = http_headers(), write_func done = write_func());
+		bool chunked()const{return chunked_;}
+
+		// Sends the body gzip or deflate encoded if the Accept-Encoding of req allows it and the
+		// content type is not one that is compressed already. A whole body must be at least
+		// min_size bytes, chunked bodies are compressed as they are written. level is the zlib
+		// level, 1 (fastest) to 9 (smallest). Bodies sent from files are left alone
+		void compress(const request& req, int level = 6, std::size_t min_size = 1024);
+		// For this response, complete once it is sent
+		compression_stats compression()const;
+		// For every response of the process
+		static compression_stats total_compression();
+		// Called with the stats of each compressed response once its body is complete, possibly
+		// from several threads at once. It can be replaced at any time, an empty function
+		// removes it. Responses finishing meanwhile may still go to the one before
+		static void set_compression_observer(std::function<void(const compression_stats&)> f);
+
 		void add_required_headers(){
-			message_["Content-Length"] = boost::lexical_cast<std::string>(message_.body().size());
-			if(message_.headers().count("Content-Type") == 0){
-				message_["Content-Type"] = 	"text/html";
+			if(!chunked_){
+				message_[http_headers::content_length] = boost::lexical_cast<std::string>(file_ ? file_length_ : message_.body().size());
+			}
+			else if(chunk_framing_){
+				message_[http_headers::transfer_encoding] = "chunked";
+			}
+			else{
+				keep_alive_ = false;
+			}
+			if(message_.headers().count(http_headers::content_type) == 0){
+				message_[http_headers::content_type] = 	"text/html";
+			}
+			auto iter = message_.headers().find(http_headers::connection);
+			if(iter == message_.headers().end()){
+				message_[http_headers::connection] = keep_alive_ ? "keep-alive" : "close";
+			}
+			else if(detail::ascii_iequals(iter->second,"close")){
+				keep_alive_ = false;
 			}
 
 		}
 		std::string get_as_http();
 
+		// Renders the header block, including the blank line that ends it
+		void render_headers(std::string& head);
+		// Renders the headers into head and hands the body over to body without copying it.
+		// Returns the status line, which refers to a static string. The response is left without a body
+		boost::asio::const_buffer release_http(std::string& head, std::string& body);
+		// Also hands over the file the body is sent from, if any
+		boost::asio::const_buffer release_http(std::string& head, std::string& body, std::shared_ptr<file_body>& file);
+
 	};
 	struct response_derived:public response{
 		void set_sender_func(std::function<void(response&) >f){sender_func_ = f;}
+		void set_chunk_sender_func(std::function<void(std::string&, bool, write_func)> f){chunk_sender_func_ = f;}
+		void set_chunk_framing(bool f){chunk_framing_ = f;}
+	};
+
+	struct body_stream_state;
+
+	// The body of a request taken by accept_streaming, read as it arrives instead of held in memory
+	class body_stream{
+	public:
+		// Called with each piece of the body, which stays valid until the connection reads on.
+		// Returning true reads on right away, false waits for resume(). Called a last time with last
+		// set and an empty chunk once the body is complete, or with ec set if the connection fails first
+		typedef std::function<bool (const boost::system::error_code& ec, string_ref chunk, bool last)> chunk_func;
+
+		explicit body_stream(std::shared_ptr<body_stream_state> s):state_(s){}
+
+		// Must be set by the handler before it returns, the body is thrown away otherwise
+		void on_chunk(chunk_func f);
+		// Reads on after a chunk_func returned false, may be called from any thread
+		void resume();
+
+	private:
+		std::shared_ptr<body_stream_state> state_;
 	};
 
 
 
 
+	// How long each phase of a server connection may take, in milliseconds, 0 for no limit.
+	// header_read runs from the start of the connection or the first byte of a request to the end
+	// of its headers, keep_alive_idle between requests and handler from a request to its response
+	// (or its next chunk). body_read and write limit each wait for more of the body or for the
+	// socket to take more of the response. A connection that runs out of time is shut down
+	struct connection_timeouts{
+		connection_timeouts():handshake(10000),header_read(30000),body_read(60000),handler(0),write(60000),keep_alive_idle(60000){}
+		long handshake;
+		long header_read;
+		long body_read;
+		long handler;
+		long write;
+		long keep_alive_idle;
+
+		static connection_timeouts none(){
+			connection_timeouts t;
+			t.handshake = t.header_read = t.body_read = t.handler = t.write = t.keep_alive_idle = 0;
+			return t;
+		}
+	};
+
 	template <class  AsyncReadStream> 
 	struct jrb_stream_reader;
 
+	struct connection_limit_state;
+
 	class http_server
 	{
 	public:
@@ -245,6 +554,7 @@ namespace jrb_node{
 		typedef std::function<bool (request&, response&, const boost::system::error_code& )> handler_func;
 		typedef std::function<bool (request&, response&)> simple_handler_func;
 		typedef std::function<void (const boost::system::error_code&) > simple_error_func;
+		typedef std::function<bool (request&, response&, body_stream&)> streaming_handler_func;
 
 
 		http_server(boost::asio::io_service& io_service, int port)
@@ -257,8 +567,12 @@ namespace jrb_node{
 		{
 		}
 
+		// reuse_port sets SO_REUSEPORT (where the platform has it) so several servers can listen on the same port
+		http_server(boost::asio::io_service& io_service,const std::string& ip, int port, bool reuse_port);
+		~http_server();
 
-		void accept_ec(handler_func func);
+
+		void accept_ec(handler_func func){accept_impl(func,nullptr);}
 		void accept(simple_handler_func f){
 			simple_error_func ef = error_func_;
 			handler_func func = [f,ef](request& req,  response& res, const boost::system::error_code& ec)->bool{
@@ -274,14 +588,62 @@ namespace jrb_node{
 			};
 			accept_ec(func);
 		}
+		// Like accept, but f is called as soon as the headers are in and reads the body through the
+		// body_stream, so an upload is never held in memory as a whole
+		void accept_streaming(streaming_handler_func f){
+			simple_error_func ef = error_func_;
+			accept_impl([ef](request&, response&, const boost::system::error_code& ec)->bool{
+				if(ec && ef){
+					ef(ec);
+				}
+				return false;
+			},f);
+		}
 		void set_error_function(simple_error_func func){error_func_ = func;}
+		// For connections accepted from now on
+		void set_timeouts(const connection_timeouts& t){timeouts_ = t;}
+		// At most max connections at once, 0 (the default) for no limit. At the limit accepting
+		// waits for a connection to close, or with shed set new connections get a 503 and are closed
+		void set_max_connections(std::size_t max, bool shed = false);
+		// connections being served, and connections turned away with a 503
+		std::size_t connections()const;
+		std::uint64_t shed_connections()const;
 	private:
+		void accept_impl(handler_func func, streaming_handler_func stream_func);
+
 		boost::asio::ip::tcp::acceptor acceptor_;
 		simple_error_func error_func_;
+		connection_timeouts timeouts_;
+		std::shared_ptr<connection_limit_state> limit_;
 
 	};
 
 #ifdef JRB_NODE_SSL
+	struct tls_handshake_pool_impl;
+
+	// Threads that do the TLS handshake work for https_server, so a burst of new connections does
+	// not hold up the requests on the serving io_service. At most max_pending handshakes are in
+	// progress, connections beyond that are closed right away
+	class tls_handshake_pool{
+	public:
+		explicit tls_handshake_pool(std::size_t threads = 1, std::size_t max_pending = 1024);
+		~tls_handshake_pool();
+
+		// handshakes in progress
+		std::size_t pending()const;
+		// connections closed because max_pending handshakes were in progress
+		std::uint64_t shed()const;
+
+	private:
+		friend class https_server;
+		boost::asio::io_service& get_io_service();
+		bool try_acquire();
+		void release();
+
+		tls_handshake_pool(const tls_handshake_pool&);
+		tls_handshake_pool& operator=(const tls_handshake_pool&);
+		std::unique_ptr<tls_handshake_pool_impl> impl_;
+	};
 
 	class https_server
 	{
@@ -291,18 +653,23 @@ namespace jrb_node{
 		typedef std::function<bool (request&, response&, const boost::system::error_code& )> handler_func;
 		typedef std::function<bool (request&, response&)> simple_handler_func;
 		typedef std::function<void (const boost::system::error_code&) > simple_error_func;
+		typedef std::function<bool (request&, response&, body_stream&)> streaming_handler_func;
 
 
 		https_server(boost::asio::io_service& io_service, int port,boost::asio::ssl::context& c)
-			: acceptor_(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),context_(c)
+			: acceptor_(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),context_(c),handshake_pool_(nullptr)
 		{
 		}
 
 		https_server(boost::asio::io_service& io_service,const std::string& ip, int port,boost::asio::ssl::context& c)
-			: acceptor_(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(ip), port)),context_(c)
+			: acceptor_(io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(ip), port)),context_(c),handshake_pool_(nullptr)
 		{
 		}
-		void accept_ec(handler_func func);
+
+		// reuse_port sets SO_REUSEPORT (where the platform has it) so several servers can listen on the same port
+		https_server(boost::asio::io_service& io_service,const std::string& ip, int port,boost::asio::ssl::context& c, bool reuse_port);
+		~https_server();
+		void accept_ec(handler_func func){accept_impl(func,nullptr);}
 		void accept(simple_handler_func f){
 			simple_error_func ef = error_func_;
 			handler_func func = [f,ef](request& req,  response& res, const boost::system::error_code& ec)->bool{
@@ -318,15 +685,134 @@ namespace jrb_node{
 			};
 			accept_ec(func);
 		}
+		// Like accept, but f is called as soon as the headers are in and reads the body through the
+		// body_stream, so an upload is never held in memory as a whole
+		void accept_streaming(streaming_handler_func f){
+			simple_error_func ef = error_func_;
+			accept_impl([ef](request&, response&, const boost::system::error_code& ec)->bool{
+				if(ec && ef){
+					ef(ec);
+				}
+				return false;
+			},f);
+		}
 		void set_error_function(simple_error_func func){error_func_ = func;}
+		// For connections accepted from now on
+		void set_timeouts(const connection_timeouts& t){timeouts_ = t;}
+		// At most max connections at once, 0 (the default) for no limit. At the limit accepting
+		// waits for a connection to close, or with shed set new connections get a 503 and are closed
+		// (https connections are reset instead, before any TLS work)
+		void set_max_connections(std::size_t max, bool shed = false);
+		// connections being served, and connections turned away
+		std::size_t connections()const;
+		std::uint64_t shed_connections()const;
+		// Do handshakes on pool, which must outlive the server. nullptr does them on the server's io_service
+		void set_handshake_pool(tls_handshake_pool* pool){handshake_pool_ = pool;}
 	private:
+		void accept_impl(handler_func func, streaming_handler_func stream_func);
+
 		boost::asio::ip::tcp::acceptor acceptor_;
 		boost::asio::ssl::context& context_;
 		simple_error_func error_func_;
+		tls_handshake_pool* handshake_pool_;
+		connection_timeouts timeouts_;
+		std::shared_ptr<connection_limit_state> limit_;
+	};
+
+	struct tls_session_cache_impl;
+
+	// Server side TLS session resumption for a context: an in memory session cache, split into
+	// shards that each have their own lock, and session tickets whose keys are replaced every
+	// ticket_key_lifetime_seconds (tickets from the previous key are still accepted and renewed).
+	// Must outlive every server using the context
+	class tls_session_cache{
+	public:
+		struct stats_type{
+			std::uint64_t cache_hits;
+			std::uint64_t cache_misses;
+			std::uint64_t ticket_hits;
+			std::uint64_t ticket_misses;
+			std::uint64_t ticket_key_rotations;
+		};
+
+		tls_session_cache(boost::asio::ssl::context& c, std::size_t max_sessions = 20000, std::size_t shards = 16, long ticket_key_lifetime_seconds = 3600);
+		~tls_session_cache();
+
+		stats_type stats()const;
+		void rotate_ticket_keys();
+
+	private:
+		tls_session_cache(const tls_session_cache&);
+		tls_session_cache& operator=(const tls_session_cache&);
+		std::unique_ptr<tls_session_cache_impl> impl_;
 	};
 
 #endif
 
+	// Runs one server per event loop, each loop on its own thread, optionally pinned to a core.
+	// The factory should create servers with reuse_port set so they all listen on the same port
+	// and the kernel spreads connections over them. Accepting, parsing, handling and writing a
+	// connection all happen on the loop that accepted it, the loops share nothing
+	template<class Server>
+	class server_group
+	{
+	public:
+		typedef std::function<std::unique_ptr<Server> (boost::asio::io_service&)> factory_func;
+		typedef typename Server::handler_func handler_func;
+		typedef typename Server::simple_handler_func simple_handler_func;
+		typedef typename Server::simple_error_func simple_error_func;
+		typedef typename Server::streaming_handler_func streaming_handler_func;
+
+		// loops == 0 uses one loop per hardware thread
+		server_group(std::size_t loops, factory_func f, bool pin_threads = false);
+
+		// each server gets its own copy of the handler
+		void accept_ec(handler_func func);
+		void accept(simple_handler_func f);
+		void accept_streaming(streaming_handler_func f);
+		void set_error_function(simple_error_func func);
+		void set_timeouts(const connection_timeouts& t);
+		// the limit is for each server
+		void set_max_connections(std::size_t max, bool shed = false);
+
+		// runs every loop on its own thread and returns once they have all stopped
+		void run();
+		void stop();
+
+		std::size_t size()const{return servers_.size();}
+		boost::asio::io_service& get_io_service(std::size_t i){return *io_services_[i];}
+		Server& server(std::size_t i){return *servers_[i];}
+
+	private:
+		std::vector<std::unique_ptr<boost::asio::io_service>> io_services_;
+		std::vector<std::unique_ptr<Server>> servers_;
+		bool pin_threads_;
+	};
+
+	typedef server_group<http_server> http_server_group;
+#ifdef JRB_NODE_SSL
+	typedef server_group<https_server> https_server_group;
+#endif
+
+	struct static_file_cache;
+
+	// A handler for accept that serves the files below root to GET and HEAD requests, with
+	// Last-Modified, If-Modified-Since and single byte ranges. Files up to max_cached_file_size
+	// stay mapped in memory, max_cache_bytes in all, and are written straight from the mapping.
+	// Larger ones go from the file to the socket with sendfile(2) on plain connections on Linux.
+	// Replace served files by renaming a new file over them: one truncated in place while its
+	// mapping is being sent can crash the process with SIGBUS.
+	// A file.gz next to a file, and not older than it, is sent instead to clients that accept gzip.
+	// Copies share the cache
+	class static_file_handler{
+	public:
+		explicit static_file_handler(const std::string& root, std::size_t max_cached_file_size = 256 * 1024, std::size_t max_cache_bytes = 64 * 1024 * 1024);
+		bool operator()(request& req, response& res);
+
+	private:
+		std::shared_ptr<static_file_cache> cache_;
+	};
+
 	template<class SocketType=boost::asio::ip::tcp::socket>
 	struct async_http_client_holder;
 
@@ -346,19 +832,56 @@ namespace jrb_node{
 		void set_uri(const uri& u);
 		const uri& get_uri(){return uri_;};
 
+		// Connections are kept open and reused per schema/host/port on each io_service.
+		// Requests beyond this many connections to one host wait for a connection (default 8)
+		static void set_max_connections_per_host(boost::asio::io_service& io, std::size_t n);
+		// Pooled connections left idle this long are closed, the next time a request to any host
+		// uses the pool of the io_service (default 30000 milliseconds, 0 for never).
+		// A request whose pooled connection turns out to be closed is sent again on a new one,
+		// unless it is a POST, which fails instead since the server may have acted on it
+		static void set_idle_timeout(boost::asio::io_service& io, long milliseconds);
+
+		// Host name lookups are cached per io_service, successful ones for ttl_seconds (default 60)
+		// and failed ones for negative_ttl_seconds (default 5)
+		static void set_dns_ttl(boost::asio::io_service& io, long ttl_seconds, long negative_ttl_seconds);
+
+		// Responses are asked for with Accept-Encoding: gzip, deflate and decoded as they are read,
+		// without their Content-Encoding and Content-Length. With raw set the body is handed over
+		// as it was sent, Content-Encoding included, for passing it on as is
+		void set_raw_body(bool raw){raw_body_ = raw;}
+		// POST bodies of at least min_size bytes are sent gzip encoded, 0 (the default) never.
+		// Only for servers that take Content-Encoding: gzip request bodies
+		void set_request_compression(std::size_t min_size){compress_min_ = min_size;}
+		// A response body that decodes to more than max_size bytes (default 64MB) fails with
+		// errc::message_size, so a small compressed body cannot expand without bound
+		void set_max_decoded_body(std::size_t max_size){max_decoded_ = max_size;}
+
 		uri uri_;
 		boost::asio::io_service* io_;
+		bool raw_body_;
+		std::size_t compress_min_;
+		std::size_t max_decoded_;
 	};
 
 	struct http_client{
 
+		// io must be run by some other thread while get or post wait
 		http_client(const uri& u, boost::asio::io_service& io):client_(u,io){}
+		// uses the shared client event loop
 		http_client(const uri& u);
 		client_response get();
 		client_response post(const std::string& data,const std::string& content_type);
 		void set_uri(const uri& u){client_.set_uri(u);}
 		const uri& get_uri(){return client_.get_uri();}
-		std::unique_ptr<boost::asio::io_service> ptr_;
+		void set_raw_body(bool raw){client_.set_raw_body(raw);}
+		void set_request_compression(std::size_t min_size){client_.set_request_compression(min_size);}
+		void set_max_decoded_body(std::size_t max_size){client_.set_max_decoded_body(max_size);}
+
+		// The shared client event loop is started on first use and runs on n background threads
+		// (default 2) for the rest of the process. Do not call get or post from those threads
+		static void set_event_loop_threads(std::size_t n);
+		static boost::asio::io_service& event_loop();
+
 		async_http_client client_;
 
 	};
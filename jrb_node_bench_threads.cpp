@@ -0,0 +1,88 @@
+//  Copyright John R. Bandela 2012
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See http://www.boost.org/LICENSE_1_0.txt)
+
+// Requests per second of one http_server whose io_service is run by 1, 2, 4 ... threads,
+// up to the number of cores, against several keep-alive clients. Built like main.cpp.
+// Usage: jrb_node_bench_threads [clients] [requests per client] [handler work in microseconds] [max io threads]
+
+#include "jrb_node.h"
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+using namespace jrb_node;
+using boost::asio::ip::tcp;
+
+namespace{
+	const unsigned short bench_port = 19292;
+
+	// Sends requests GETs on one keep-alive connection, reading each response before the next
+	void run_client(int requests){
+		boost::asio::io_service io;
+		tcp::socket sock(io);
+		sock.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"),bench_port));
+		const std::string request = "GET /bench HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+		boost::asio::streambuf in;
+		for(int i = 0; i < requests; ++i){
+			boost::asio::write(sock,boost::asio::buffer(request));
+			std::size_t n = boost::asio::read_until(sock,in,"\r\n\r\n");
+			std::string head(boost::asio::buffers_begin(in.data()),boost::asio::buffers_begin(in.data()) + n);
+			in.consume(n);
+			std::size_t length = 0;
+			auto pos = head.find("Content-Length: ");
+			if(pos != std::string::npos) length = std::strtoul(head.c_str() + pos + 16,nullptr,10);
+			if(in.size() < length) boost::asio::read(sock,in,boost::asio::transfer_exactly(length - in.size()));
+			in.consume(length);
+		}
+	}
+
+	double run(int threads, int clients, int requests, int work_us){
+		boost::asio::io_service io;
+		http_server server(io,"127.0.0.1",bench_port,false);
+		server.accept([work_us](request&, response& res)->bool{
+			// stands in for a handler that does real work
+			auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(work_us);
+			while(std::chrono::steady_clock::now() < until){}
+			res.body("hello");
+			return true;
+		});
+		std::vector<std::thread> io_threads;
+		for(int i = 0; i < threads; ++i){
+			io_threads.push_back(std::thread([&io]{io.run();}));
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> client_threads;
+		for(int i = 0; i < clients; ++i){
+			client_threads.push_back(std::thread([requests]{run_client(requests);}));
+		}
+		for(auto& t:client_threads) t.join();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		io.stop();
+		for(auto& t:io_threads) t.join();
+		return clients * requests / seconds;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int clients = argc > 1 ? std::atoi(argv[1]) : 8;
+	int requests = argc > 2 ? std::atoi(argv[2]) : 5000;
+	int work_us = argc > 3 ? std::atoi(argv[3]) : 20;
+	int cores = argc > 4 ? std::atoi(argv[4]) : static_cast<int>(std::thread::hardware_concurrency());
+	if(cores < 1) cores = 1;
+
+	std::cout << clients << " clients, " << requests << " requests each, " << work_us << "us handler, up to " << cores << " io threads" << std::endl;
+	for(int threads = 1; ; threads *= 2){
+		if(threads > cores) threads = cores;
+		std::cout << threads << " io threads: " << static_cast<long>(run(threads,clients,requests,work_us)) << " requests/s" << std::endl;
+		if(threads == cores) break;
+	}
+	return 0;
+}
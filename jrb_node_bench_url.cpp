@@ -0,0 +1,156 @@
+//  Copyright John R. Bandela 2012
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See http://www.boost.org/LICENSE_1_0.txt)
+
+// Bytes per second of url_encode and url_decode on 1MB inputs. The std::string versions
+// scan runs with AVX2 or SSE2 when the build enables them, the iterator versions go a byte
+// at a time through the tables, and "before" is the std::find based code they replaced.
+// Needs only jrb_node_name_value.h and boost headers.
+// Usage: jrb_node_bench_url [seconds per measurement]
+
+#include "jrb_node_name_value.h"
+#include <iostream>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace{
+	double measure_seconds = 0.5;
+
+	// url_encode and url_decode as they were before the tables, for comparison
+	namespace before{
+		std::string hex_encode(unsigned char c){
+			static const char nibble[] = "0123456789ABCDEF";
+			std::string ret;
+			ret += nibble[c >> 4];
+			ret += nibble[c & 0x0f];
+			return ret;
+		}
+		unsigned char hex_decode(const std::string& s){
+			static const char nibble[] = "0123456789ABCDEF";
+			if(s.size() < 2) throw std::runtime_error("Invalid hex string");
+			auto iter1 = std::find(std::begin(nibble),std::end(nibble),s[0]);
+			if(iter1 == std::end(nibble))throw std::runtime_error("Invalid hex string");
+			auto iter2 = std::find(std::begin(nibble),std::end(nibble),s[1]);
+			if(iter2 == std::end(nibble))throw std::runtime_error("Invalid hex string");
+			unsigned char c1 = iter1 - std::begin(nibble);
+			unsigned char c2 = iter2 - std::begin(nibble);
+			unsigned char c = (c1 << 4) | c2;
+			return c;
+		}
+
+		template<class InIt,class OutIt>
+		void url_encode(InIt begin, InIt end, OutIt out){
+			static const char safe[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~";
+			for(auto iter = begin; iter != end; ++iter){
+				auto f = std::find(std::begin(safe),std::end(safe),*iter);
+				if(f != std::end(safe)){ *out++ = *f;}
+				else{
+					std::string hex = hex_encode(*iter);
+					hex = "%" + hex;
+					std::copy(hex.begin(),hex.end(),out);
+				}
+			}
+		}
+		template<class InIt, class OutIt>
+		void url_decode(InIt begin, InIt end, OutIt out){
+			for(auto iter = begin; iter != end; ++iter){
+				if(*iter=='%'){
+					++iter;
+					auto b = iter;
+					if(iter == end){throw std::runtime_error("Invalid hex string");}
+					++iter;
+					if(iter == end){throw std::runtime_error("Invalid hex string");}
+					auto e = iter;
+					++e;
+					std::string hex_string(b,e);
+					*out++ = hex_decode(hex_string);
+				}
+				else{
+					*out++ = *iter;
+				}
+			}
+		}
+
+		std::string url_encode(const std::string& s){
+			std::string ret;
+			url_encode(s.begin(),s.end(),std::back_inserter(ret));
+			return ret;
+		}
+		std::string url_decode(const std::string& s){
+			std::string ret;
+			url_decode(s.begin(),s.end(),std::back_inserter(ret));
+			return ret;
+		}
+	}
+
+	// MB/s of f over bytes, repeating f for measure_seconds
+	template<class F>
+	double rate(F f, std::size_t bytes){
+		auto start = std::chrono::steady_clock::now();
+		std::size_t runs = 0;
+		double elapsed = 0;
+		do{
+			f();
+			++runs;
+			elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}while(elapsed < measure_seconds);
+		return bytes * runs / elapsed / 1e6;
+	}
+
+	void bench(const char* name, const std::string& input){
+		std::string encoded = jrb_node::url_encode(input);
+		volatile std::size_t sink = 0;
+		double encode_string = rate([&]{sink += jrb_node::url_encode(input).size();},input.size());
+		double encode_iter = rate([&]{
+			std::string out;
+			out.reserve(input.size() * 3);
+			jrb_node::url_encode(input.begin(),input.end(),std::back_inserter(out));
+			sink += out.size();
+		},input.size());
+		double decode_string = rate([&]{sink += jrb_node::url_decode(encoded).size();},encoded.size());
+		double decode_iter = rate([&]{
+			std::string out;
+			out.reserve(encoded.size());
+			jrb_node::url_decode(encoded.begin(),encoded.end(),std::back_inserter(out));
+			sink += out.size();
+		},encoded.size());
+		double encode_before = rate([&]{sink += before::url_encode(input).size();},input.size());
+		double decode_before = rate([&]{sink += before::url_decode(encoded).size();},encoded.size());
+		std::cout << name << "\n"
+			<< "  encode " << static_cast<long>(encode_string) << " MB/s, per byte " << static_cast<long>(encode_iter) << " MB/s, before " << static_cast<long>(encode_before) << " MB/s\n"
+			<< "  decode " << static_cast<long>(decode_string) << " MB/s, per byte " << static_cast<long>(decode_iter) << " MB/s, before " << static_cast<long>(decode_before) << " MB/s" << std::endl;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if(argc > 1) measure_seconds = std::atof(argv[1]);
+#if defined(JRB_NODE_URL_AVX2)
+	std::cout << "runs scanned with AVX2" << std::endl;
+#elif defined(JRB_NODE_URL_SSE2)
+	std::cout << "runs scanned with SSE2" << std::endl;
+#else
+	std::cout << "runs scanned with tables only" << std::endl;
+#endif
+
+	std::mt19937 rng(1);
+	const std::size_t size = 1 << 20;
+	// text that is nearly all unreserved, like most names and values
+	std::string mostly_safe;
+	while(mostly_safe.size() < size){
+		mostly_safe += "abcdefghijklmnopqrstuvwxyz0123456789"[rng() % 36];
+		if(rng() % 64 == 0) mostly_safe += ' ';
+	}
+	// text where about half the bytes need escaping
+	std::string mixed;
+	while(mixed.size() < size){
+		mixed += "ab /&=?\xc3\xa9"[rng() % 9];
+	}
+	bench("mostly unreserved",mostly_safe);
+	bench("mixed",mixed);
+	return 0;
+}
@@ -8,108 +8,404 @@
 
 #include <string>
 #include <exception>
+#include <stdexcept>
 #include <iterator>
 #include <algorithm>
 #include <vector>
+#include <cstring>
 #include <boost/algorithm/string.hpp>
+#include <boost/system/error_code.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define JRB_NODE_URL_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define JRB_NODE_URL_SSE2
+#endif
+#if defined(_MSC_VER) && (defined(JRB_NODE_URL_SSE2) || defined(JRB_NODE_URL_AVX2))
+#include <intrin.h>
+#endif
 
 namespace jrb_node{
 
+	// A non owning reference to a run of characters, such as a token in a connection's read buffer
+	struct string_ref{
+		typedef const char* iterator;
+		typedef const char* const_iterator;
+
+		string_ref():data_(nullptr),size_(0){}
+		string_ref(const char* d, std::size_t s):data_(d),size_(s){}
+		string_ref(const char* s):data_(s),size_(std::char_traits<char>::length(s)){}
+		string_ref(const std::string& s):data_(s.data()),size_(s.size()){}
+
+		const char* data()const{return data_;}
+		std::size_t size()const{return size_;}
+		bool empty()const{return size_ == 0;}
+		const_iterator begin()const{return data_;}
+		const_iterator end()const{return data_ + size_;}
+		char operator[](std::size_t i)const{return data_[i];}
+
+		std::string to_string()const{return std::string(data_,size_);}
+
+		friend bool operator==(const string_ref& a, const string_ref& b){
+			return a.size_ == b.size_ && std::equal(a.begin(),a.end(),b.begin());
+		}
+		friend bool operator!=(const string_ref& a, const string_ref& b){return !(a == b);}
+
+	private:
+		const char* data_;
+		std::size_t size_;
+	};
+
 	namespace detail{
 
+		// 1 for the bytes url_encode leaves as they are: letters, digits and -_.~
+		inline const unsigned char* url_safe_table(){
+			static const unsigned char table[256] = {
+				0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+				0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+				0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,0,
+				1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,
+				0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+				1,1,1,1,1,1,1,1,1,1,1,0,0,0,0,1,
+				0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+				1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,0,
+				0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+				0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+				0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+				0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+				0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+				0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+				0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+				0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+			};
+			return table;
+		}
+		// The value of a hex digit, either case, -1 for other bytes
+		inline const signed char* hex_value_table(){
+			static const signed char table[256] = {
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				0,1,2,3,4,5,6,7,8,9,-1,-1,-1,-1,-1,-1,
+				-1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+				-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+			};
+			return table;
+		}
+		inline const char* hex_digits(){return "0123456789ABCDEF";}
+
+		inline bool url_safe(unsigned char c){return url_safe_table()[c] != 0;}
+
 		inline std::string hex_encode(unsigned char c){
-			static const char nibble[] = "0123456789ABCDEF";
-			std::string ret;
-			ret += nibble[c >> 4];
-			ret += nibble[c & 0x0f];
+			std::string ret(2,'0');
+			ret[0] = hex_digits()[c >> 4];
+			ret[1] = hex_digits()[c & 0x0f];
 			return ret;
 		}
 		inline unsigned char hex_decode(const std::string& s){
-			static const char nibble[] = "0123456789ABCDEF";
 			if(s.size() < 2) throw std::runtime_error("Invalid hex string");
-			auto iter1 = std::find(std::begin(nibble),std::end(nibble),s[0]);
-			if(iter1 == std::end(nibble))throw std::runtime_error("Invalid hex string");
-			auto iter2 = std::find(std::begin(nibble),std::end(nibble),s[1]);
-			if(iter2 == std::end(nibble))throw std::runtime_error("Invalid hex string");
-			unsigned char c1 = iter1 - std::begin(nibble);
-			unsigned char c2 = iter2 - std::begin(nibble);
-			unsigned char c = (c1 << 4) | c2;
-			return c;
+			int c1 = hex_value_table()[static_cast<unsigned char>(s[0])];
+			int c2 = hex_value_table()[static_cast<unsigned char>(s[1])];
+			if(c1 < 0 || c2 < 0) throw std::runtime_error("Invalid hex string");
+			return static_cast<unsigned char>((c1 << 4) | c2);
+		}
+
+#if defined(JRB_NODE_URL_SSE2) || defined(JRB_NODE_URL_AVX2)
+		inline unsigned lowest_bit(unsigned m){
+#ifdef _MSC_VER
+			unsigned long i;
+			_BitScanForward(&i,m);
+			return i;
+#else
+			return __builtin_ctz(m);
+#endif
+		}
+#endif
+
+		// The number of bytes at the start of [p,e) that url_encode leaves as they are. Blocks of
+		// 32 or 16 are checked at once where AVX2 or SSE2 is available. Bytes from 0x80 are
+		// negative as signed chars and so fall outside every range
+		inline std::size_t url_safe_run(const char* p, const char* e){
+			const char* b = p;
+#ifdef JRB_NODE_URL_AVX2
+			while(e - p >= 32){
+				__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+				__m256i lower = _mm256_or_si256(x,_mm256_set1_epi8(0x20));
+				__m256i safe = _mm256_and_si256(_mm256_cmpgt_epi8(x,_mm256_set1_epi8('0' - 1)),_mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1),x));
+				safe = _mm256_or_si256(safe,_mm256_and_si256(_mm256_cmpgt_epi8(lower,_mm256_set1_epi8('a' - 1)),_mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1),lower)));
+				safe = _mm256_or_si256(safe,_mm256_or_si256(_mm256_cmpeq_epi8(x,_mm256_set1_epi8('-')),_mm256_cmpeq_epi8(x,_mm256_set1_epi8('_'))));
+				safe = _mm256_or_si256(safe,_mm256_or_si256(_mm256_cmpeq_epi8(x,_mm256_set1_epi8('.')),_mm256_cmpeq_epi8(x,_mm256_set1_epi8('~'))));
+				unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(safe));
+				if(mask) return p - b + lowest_bit(mask);
+				p += 32;
+			}
+#endif
+#ifdef JRB_NODE_URL_SSE2
+			while(e - p >= 16){
+				__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+				__m128i lower = _mm_or_si128(x,_mm_set1_epi8(0x20));
+				__m128i safe = _mm_and_si128(_mm_cmpgt_epi8(x,_mm_set1_epi8('0' - 1)),_mm_cmplt_epi8(x,_mm_set1_epi8('9' + 1)));
+				safe = _mm_or_si128(safe,_mm_and_si128(_mm_cmpgt_epi8(lower,_mm_set1_epi8('a' - 1)),_mm_cmplt_epi8(lower,_mm_set1_epi8('z' + 1))));
+				safe = _mm_or_si128(safe,_mm_or_si128(_mm_cmpeq_epi8(x,_mm_set1_epi8('-')),_mm_cmpeq_epi8(x,_mm_set1_epi8('_'))));
+				safe = _mm_or_si128(safe,_mm_or_si128(_mm_cmpeq_epi8(x,_mm_set1_epi8('.')),_mm_cmpeq_epi8(x,_mm_set1_epi8('~'))));
+				unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(safe)) & 0xffff;
+				if(mask) return p - b + lowest_bit(mask);
+				p += 16;
+			}
+#endif
+			while(p != e && url_safe(static_cast<unsigned char>(*p))) ++p;
+			return p - b;
+		}
+
+		// The number of bytes at the start of [p,e) before the first '%'
+		inline std::size_t url_plain_run(const char* p, const char* e){
+			const char* b = p;
+#ifdef JRB_NODE_URL_AVX2
+			while(e - p >= 32){
+				__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+				unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x,_mm256_set1_epi8('%'))));
+				if(mask) return p - b + lowest_bit(mask);
+				p += 32;
+			}
+#endif
+#ifdef JRB_NODE_URL_SSE2
+			while(e - p >= 16){
+				__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+				unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x,_mm_set1_epi8('%'))));
+				if(mask) return p - b + lowest_bit(mask);
+				p += 16;
+			}
+#endif
+			while(p != e && *p != '%') ++p;
+			return p - b;
 		}
 
 	}
 
 	template<class InIt,class OutIt>
 	void url_encode(InIt begin, InIt end, OutIt out){
-		static const char safe[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~";
 		for(auto iter = begin; iter != end; ++iter){
-			auto f = std::find(std::begin(safe),std::end(safe),*iter);
-			if(f != std::end(safe)){ *out++ = *f;}
+			unsigned char c = static_cast<unsigned char>(*iter);
+			if(detail::url_safe(c)){ *out++ = *iter;}
 			else{
-				std::string hex = detail::hex_encode(*iter);
-				hex = "%" + hex;
-				std::copy(hex.begin(),hex.end(),out);
+				*out++ = '%';
+				*out++ = detail::hex_digits()[c >> 4];
+				*out++ = detail::hex_digits()[c & 0x0f];
 			}
-
 		}
-
-
 	}
+
+	// Sets ec to invalid_argument if a % is not followed by two hex digits, of either case.
+	// What was decoded before that is already written to out
 	template<class InIt, class OutIt>
-	void url_decode(InIt begin, InIt end, OutIt out){
+	void url_decode(InIt begin, InIt end, OutIt out, boost::system::error_code& ec){
 		for(auto iter = begin; iter != end; ++iter){
 			if(*iter=='%'){
-				++iter;
-				auto b = iter;
-				if(iter == end){throw std::runtime_error("Invalid hex string");}
-				++iter;
-				if(iter == end){throw std::runtime_error("Invalid hex string");}
-				auto e = iter;
-				++e;
-				std::string hex_string(b,e);
-				*out++ = detail::hex_decode(hex_string);
+				int c1 = -1, c2 = -1;
+				if(++iter != end){
+					c1 = detail::hex_value_table()[static_cast<unsigned char>(*iter)];
+					if(++iter != end){
+						c2 = detail::hex_value_table()[static_cast<unsigned char>(*iter)];
+					}
+				}
+				if(c1 < 0 || c2 < 0){
+					ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+					return;
+				}
+				*out++ = static_cast<char>((c1 << 4) | c2);
 			}
 			else{
 				*out++ = *iter;
 			}
-
-
-
 		}
+		ec = boost::system::error_code();
+	}
+	template<class InIt, class OutIt>
+	void url_decode(InIt begin, InIt end, OutIt out){
+		boost::system::error_code ec;
+		url_decode(begin,end,out,ec);
+		if(ec) throw std::runtime_error("Invalid hex string");
+	}
 
-
+	// The string versions copy runs of bytes that need no work in bulk
+	// out is sized for the worst case once and written through a pointer, so a short run or
+	// an escape costs no call into std::string
+	inline void url_encode_append(const char* begin, const char* end, std::string& out){
+		if(begin == end) return;
+		std::size_t start = out.size();
+		out.resize(start + 3 * (end - begin));
+		char* o = &out[start];
+		while(begin != end){
+			if(detail::url_safe(static_cast<unsigned char>(*begin))){
+				std::size_t n = detail::url_safe_run(begin,end);
+				std::memcpy(o,begin,n);
+				o += n;
+				begin += n;
+				if(begin == end) break;
+			}
+			unsigned char c = static_cast<unsigned char>(*begin++);
+			o[0] = '%';
+			o[1] = detail::hex_digits()[c >> 4];
+			o[2] = detail::hex_digits()[c & 0x0f];
+			o += 3;
+		}
+		out.resize(o - out.data());
+	}
+	// plus_as_space also turns a literal '+' into a space, but not an encoded one
+	inline void url_decode_append(const char* begin, const char* end, std::string& out, boost::system::error_code& ec, bool plus_as_space = false){
+		ec = boost::system::error_code();
+		if(begin == end) return;
+		std::size_t start = out.size();
+		out.resize(start + (end - begin));
+		char* o = &out[start];
+		while(begin != end){
+			if(*begin != '%'){
+				std::size_t n = detail::url_plain_run(begin,end);
+				std::memcpy(o,begin,n);
+				if(plus_as_space) std::replace(o,o + n,'+',' ');
+				o += n;
+				begin += n;
+				if(begin == end) break;
+			}
+			int c1 = -1, c2 = -1;
+			if(end - begin >= 3){
+				c1 = detail::hex_value_table()[static_cast<unsigned char>(begin[1])];
+				c2 = detail::hex_value_table()[static_cast<unsigned char>(begin[2])];
+			}
+			if(c1 < 0 || c2 < 0){
+				ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+				break;
+			}
+			*o++ = static_cast<char>((c1 << 4) | c2);
+			begin += 3;
+		}
+		out.resize(o - out.data());
 	}
 
 	inline std::string url_encode(const std::string& s){
 		std::string ret;
-		url_encode(s.begin(),s.end(),std::back_inserter(ret));
+		url_encode_append(s.data(),s.data() + s.size(),ret);
 		return ret;
 
 
 	}
-	inline std::string url_decode(const std::string& s){
+	inline std::string url_decode(const std::string& s, boost::system::error_code& ec){
 		std::string ret;
-		url_decode(s.begin(),s.end(),std::back_inserter(ret));
+		url_decode_append(s.data(),s.data() + s.size(),ret,ec);
+		return ret;
+	}
+	inline std::string url_decode(const std::string& s){
+		boost::system::error_code ec;
+		std::string ret = url_decode(s,ec);
+		if(ec) throw std::runtime_error("Invalid hex string");
 		return ret;
 
 
 	}
 
 
-	template<class MapType>
-	void parse_name_value(const std::string& s, MapType& m){
-		std::vector<std::string> pairs;
-		boost::algorithm::split(pairs,s,[](char c){return c=='&';});
-		for(const auto& p:pairs){
-			std::vector<std::string> pair;
-			boost::algorithm::split(pair,p,[](char c){return c=='=';});
-			if(!pair.size()) continue;
-			if(!pair[0].size())continue;
-			if(pair.size() < 2)pair.push_back(std::string());
-			m[url_decode(pair[0])] = url_decode(pair[1]);
+	// Decodes a query string or form component, where '+' also stands for a space
+	inline void form_decode_append(const char* begin, const char* end, std::string& out, boost::system::error_code& ec){
+		url_decode_append(begin,end,out,ec,true);
+	}
+
+	// One pair of a query string or form body. name and value point into the parsed text
+	// and are still encoded; the flags say whether they hold a '%' or '+' at all
+	struct name_value_ref{
+		string_ref name;
+		string_ref value;
+		bool name_encoded;
+		bool value_encoded;
+
+		name_value_ref():name_encoded(false),value_encoded(false){}
+
+		// Return the component as it is when it needs no decoding, otherwise decode it
+		// into buffer and return that
+		string_ref decoded_name(std::string& buffer, boost::system::error_code& ec)const{
+			return decode(name,name_encoded,buffer,ec);
+		}
+		string_ref decoded_value(std::string& buffer, boost::system::error_code& ec)const{
+			return decode(value,value_encoded,buffer,ec);
+		}
 
+	private:
+		static string_ref decode(const string_ref& s, bool encoded, std::string& buffer, boost::system::error_code& ec){
+			ec = boost::system::error_code();
+			if(!encoded) return s;
+			buffer.clear();
+			form_decode_append(s.begin(),s.end(),buffer,ec);
+			return buffer;
+		}
+	};
+
+	// Walks the name=value pairs of a query string or form body in one pass without allocating.
+	// Pairs with an empty name are skipped and a pair without '=' has an empty value
+	class name_value_parser{
+	public:
+		explicit name_value_parser(const string_ref& s):p_(s.begin()),end_(s.end()){}
+
+		bool next(name_value_ref& pair){
+			while(p_ != end_){
+				const char* name = p_;
+				const char* eq = nullptr;
+				bool encoded[2] = {false,false};
+				for(; p_ != end_ && *p_ != '&'; ++p_){
+					char c = *p_;
+					if(c == '=' && !eq) eq = p_;
+					else if(c == '%' || c == '+') encoded[eq != nullptr] = true;
+				}
+				const char* name_end = eq ? eq : p_;
+				const char* value = eq ? eq + 1 : p_;
+				const char* value_end = p_;
+				if(p_ != end_) ++p_;
+				if(name == name_end) continue;
+				pair.name = string_ref(name,name_end - name);
+				pair.value = string_ref(value,value_end - value);
+				pair.name_encoded = encoded[0];
+				pair.value_encoded = encoded[1];
+				return true;
+			}
+			return false;
 		}
 
+	private:
+		const char* p_;
+		const char* end_;
+	};
+
+	// Fills m with the decoded pairs, later duplicates replacing earlier ones
+	template<class MapType>
+	void parse_name_value(const string_ref& s, MapType& m, boost::system::error_code& ec){
+		name_value_parser parser(s);
+		name_value_ref pair;
+		std::string name_buffer, value_buffer;
+		while(parser.next(pair)){
+			string_ref name = pair.decoded_name(name_buffer,ec);
+			if(ec) return;
+			string_ref value = pair.decoded_value(value_buffer,ec);
+			if(ec) return;
+			m[name.to_string()] = value.to_string();
+		}
+		ec = boost::system::error_code();
+	}
+	template<class MapType>
+	void parse_name_value(const string_ref& s, MapType& m){
+		boost::system::error_code ec;
+		parse_name_value(string_ref(s),m,ec);
+		if(ec) throw std::runtime_error("Invalid hex string");
 	}
 
 	template<class MapType>
@@ -0,0 +1,665 @@
+//  Copyright John R. Bandela 2012
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See http://www.boost.org/LICENSE_1_0.txt)
+
+// Regression checks, built like main.cpp and run from the directory with jrb.cer and jrb.pkey.
+// Prints each failed check and returns the number of failures
+
+#include "jrb_node.h"
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <zlib.h>
+
+using namespace jrb_node;
+
+namespace{
+	int failures = 0;
+
+	void check(bool ok, const char* what){
+		if(!ok){
+			++failures;
+			std::cout << "FAILED: " << what << std::endl;
+		}
+	}
+
+	// Polls f every few milliseconds for up to ms, returns its last result
+	template<class F>
+	bool wait_for(F f, long ms){
+		auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+		while(!f()){
+			if(std::chrono::steady_clock::now() >= end) return false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+		return true;
+	}
+
+	std::size_t count_of(const std::string& s, const std::string& what){
+		std::size_t n = 0;
+		for(std::size_t pos = s.find(what); pos != std::string::npos; pos = s.find(what,pos + what.size())) ++n;
+		return n;
+	}
+
+	// An http_server on 127.0.0.1 with a thread running its io_service until the object goes
+	struct local_server{
+		boost::asio::io_service io;
+		http_server server;
+		std::thread thread;
+
+		explicit local_server(int port):server(io,"127.0.0.1",port){}
+		~local_server(){
+			io.stop();
+			if(thread.joinable()) thread.join();
+		}
+		void run(){thread = std::thread([this]{io.run();});}
+	};
+
+	// A client connection whose reads give up after a while, so a missing response fails a check
+	// instead of hanging the test
+	struct test_connection{
+		boost::asio::io_service io;
+		boost::asio::ip::tcp::socket socket;
+		bool closed;
+
+		explicit test_connection(int port):socket(io),closed(false){
+			socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"),port));
+		}
+
+		void send(const std::string& text){boost::asio::write(socket,boost::asio::buffer(text));}
+
+		// Appends what arrives within ms to out, false if nothing did. Sets closed once the
+		// server has closed the connection
+		bool read(std::string& out, long ms){
+			std::array<char,8192> buffer;
+			std::size_t n = 0;
+			boost::system::error_code error;
+			boost::asio::deadline_timer timer(io);
+			timer.expires_from_now(boost::posix_time::milliseconds(ms));
+			timer.async_wait([this](const boost::system::error_code& ec){
+				boost::system::error_code ignored;
+				if(!ec) socket.cancel(ignored);
+			});
+			socket.async_read_some(boost::asio::buffer(buffer),[&](const boost::system::error_code& ec, std::size_t k){
+				error = ec;
+				n = k;
+				timer.cancel();
+			});
+			io.reset();
+			io.run();
+			out.append(buffer.data(),n);
+			if(error && error != boost::asio::error::operation_aborted) closed = true;
+			return n != 0;
+		}
+
+		// Reads until out holds count of what, false if that takes longer than ms
+		bool read_until(std::string& out, const std::string& what, std::size_t count, long ms){
+			auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+			while(count_of(out,what) < count){
+				long left = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count());
+				if(closed || left <= 0) return false;
+				read(out,left);
+			}
+			return true;
+		}
+
+		// Reads until the server closes the connection, false if that takes longer than ms
+		bool read_until_closed(std::string& out, long ms){
+			auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+			while(!closed){
+				long left = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(end - std::chrono::steady_clock::now()).count());
+				if(left <= 0) return false;
+				read(out,left);
+			}
+			return true;
+		}
+	};
+
+	// Pipelined requests are answered in order whatever order the handlers send in, and no more
+	// than 16 wait for a response before the connection stops reading requests
+	void test_pipelining(){
+		local_server s(19301);
+		std::mutex mutex;
+		std::vector<response> held;
+		s.server.accept([&](request& req, response& res)->bool{
+			res.body("[" + req.url().substr(1) + "]");
+			std::lock_guard<std::mutex> lock(mutex);
+			held.push_back(res);
+			return false;
+		});
+		s.run();
+		auto held_count = [&]()->std::size_t{
+			std::lock_guard<std::mutex> lock(mutex);
+			return held.size();
+		};
+		// sends the held responses last first
+		auto send_held = [&]{
+			std::vector<response> sending;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				sending.swap(held);
+			}
+			for(auto iter = sending.rbegin(); iter != sending.rend(); ++iter) iter->send();
+		};
+
+		test_connection c(19301);
+		std::string requests;
+		for(int i = 0; i < 20; ++i){
+			requests += "GET /" + boost::lexical_cast<std::string>(i) + " HTTP/1.1\r\nHost: a\r\n\r\n";
+		}
+		c.send(requests);
+		check(wait_for([&]{return held_count() >= 16;},2000),"pipelined requests reach the handler");
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		check(held_count() == 16,"at most 16 pipelined requests wait for a response");
+		std::string out;
+		c.read(out,100);
+		check(out.empty(),"nothing is written before the first response is sent");
+		send_held();
+		check(wait_for([&]{return held_count() == 4;},2000),"the rest are read once responses go out");
+		send_held();
+		check(c.read_until(out,"HTTP/1.1 200",20,2000),"every pipelined request is answered");
+		std::size_t last = 0;
+		bool ordered = true;
+		for(int i = 0; i < 20; ++i){
+			std::size_t pos = out.find("[" + boost::lexical_cast<std::string>(i) + "]");
+			if(pos == std::string::npos || pos < last) ordered = false;
+			else last = pos;
+		}
+		check(ordered,"pipelined responses come in request order");
+	}
+
+	// A pooled connection the server has closed is noticed before a request is sent on it, so a
+	// POST, which is never sent twice, still gets through
+	void test_client_pool_stale_connection(){
+		local_server s(19302);
+		connection_timeouts timeouts = connection_timeouts::none();
+		timeouts.keep_alive_idle = 100;
+		s.server.set_timeouts(timeouts);
+		s.server.accept([](request& req, response& res)->bool{
+			res.body(req.method());
+			return true;
+		});
+		s.run();
+
+		boost::asio::io_service client_io;
+		std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(client_io));
+		std::thread client_thread([&]{client_io.run();});
+		{
+			http_client client(uri("http://127.0.0.1:19302/"),client_io);
+			try{
+				check(client.get().body() == "GET","a GET gets through");
+				check(wait_for([&]{return s.server.connections() == 0;},2000),"the server closes the idle connection");
+				check(client.post("x","text/plain").body() == "POST","a POST after the server closed the pooled connection gets through");
+			}
+			catch(std::exception& e){
+				check(false,e.what());
+			}
+		}
+		work.reset();
+		client_thread.join();
+	}
+
+	// A chunked response is framed chunk by chunk and ended by the empty chunk, after which the
+	// connection goes on to the next request
+	void test_chunked_response(){
+		local_server s(19303);
+		s.server.accept([](request& req, response& res)->bool{
+			if(req.url() != "/chunked"){
+				res.body("plain");
+				return true;
+			}
+			res.send_headers();
+			res.write_chunk("hello");
+			res.write_chunk("world");
+			res.end_chunks();
+			return false;
+		});
+		s.run();
+
+		test_connection c(19303);
+		c.send("GET /chunked HTTP/1.1\r\nHost: a\r\n\r\nGET /plain HTTP/1.1\r\nHost: a\r\n\r\n");
+		std::string out;
+		check(c.read_until(out,"HTTP/1.1 200",2,2000),"both responses arrive on one connection");
+		std::size_t second = out.find("HTTP/1.1 200",1);
+		std::string first = out.substr(0,second);
+		check(first.find("Transfer-Encoding: chunked\r\n") != std::string::npos,"a chunked response says so");
+		std::size_t body = first.find("\r\n\r\n");
+		check(body != std::string::npos && first.substr(body + 4) == "5\r\nhello\r\n5\r\nworld\r\n0\r\n\r\n","chunks are framed and ended by the empty chunk");
+		c.read_until(out,"plain",1,2000);
+		check(out.size() >= 5 && out.compare(out.size() - 5,5,"plain") == 0,"the next response follows the last chunk");
+		check(!c.closed,"the connection stays open after a chunked response");
+	}
+
+	// The head and the body of the response to a request on its own connection
+	struct raw_response{
+		std::string head;
+		std::string body;
+		bool has(const std::string& line)const{return head.find("\r\n" + line + "\r\n") != std::string::npos;}
+	};
+
+	raw_response fetch(int port, const std::string& request){
+		test_connection c(port);
+		c.send(request);
+		std::string out;
+		c.read_until_closed(out,2000);
+		raw_response r;
+		std::size_t end = out.find("\r\n\r\n");
+		r.head = out.substr(0,end == std::string::npos ? out.size() : end + 2);
+		if(end != std::string::npos) r.body = out.substr(end + 4);
+		return r;
+	}
+
+	// Ranges, conditional requests, HEAD and paths that try to leave the root, served from jrb.cer
+	void test_static_files(){
+		std::ifstream f("jrb.cer",std::ios::binary);
+		std::string file((std::istreambuf_iterator<char>(f)),std::istreambuf_iterator<char>());
+		check(file.size() > 10,"jrb.cer is in the working directory");
+		std::string size = boost::lexical_cast<std::string>(file.size());
+
+		local_server s(19304);
+		s.server.accept(static_file_handler("."));
+		s.run();
+		auto get = [](const std::string& path, const std::string& headers){
+			return fetch(19304,"GET " + path + " HTTP/1.1\r\nHost: a\r\nConnection: close\r\n" + headers + "\r\n");
+		};
+
+		raw_response r = get("/jrb.cer","");
+		check(r.head.compare(0,15,"HTTP/1.1 200 OK") == 0 && r.body == file,"a file is sent whole");
+		std::size_t lm = r.head.find("Last-Modified: ");
+		std::string last_modified = lm == std::string::npos ? "" : r.head.substr(lm + 15,r.head.find("\r\n",lm) - lm - 15);
+
+		r = get("/jrb.cer","Range: bytes=0-9\r\n");
+		check(r.head.compare(0,12,"HTTP/1.1 206") == 0 && r.has("Content-Range: bytes 0-9/" + size) && r.body == file.substr(0,10),"a range gets 206 and the bytes in it");
+		r = get("/jrb.cer","Range: bytes=-5\r\n");
+		check(r.head.compare(0,12,"HTTP/1.1 206") == 0 && r.body == file.substr(file.size() - 5),"a suffix range gets the end of the file");
+		r = get("/jrb.cer","Range: bytes=" + size + "-\r\n");
+		check(r.head.compare(0,12,"HTTP/1.1 416") == 0 && r.has("Content-Range: bytes */" + size),"a range past the end gets 416");
+
+		r = get("/jrb.cer","If-Modified-Since: " + last_modified + "\r\n");
+		check(r.head.compare(0,12,"HTTP/1.1 304") == 0 && r.has("Content-Length: " + size) && r.body.empty(),"304 without a body but with the length of the file");
+		r = get("/jrb.cer","If-Modified-Since: Fri, 31 Dec 2100 23:59:59 GMT\r\n");
+		check(r.head.compare(0,12,"HTTP/1.1 304") == 0,"a later date gets 304");
+		r = get("/jrb.cer","If-Modified-Since: Thursday, 31-Dec-69 23:59:59 GMT\r\n");
+		check(r.head.compare(0,12,"HTTP/1.1 304") == 0,"a later date in RFC 850 form gets 304");
+		r = get("/jrb.cer","If-Modified-Since: Fri Dec 31 23:59:59 2100\r\n");
+		check(r.head.compare(0,12,"HTTP/1.1 304") == 0,"a later date in asctime form gets 304");
+		r = get("/jrb.cer","If-Modified-Since: Thu, 01 Jan 1970 00:00:01 GMT\r\n");
+		check(r.head.compare(0,15,"HTTP/1.1 200 OK") == 0 && r.body == file,"an earlier date gets the file");
+		r = get("/jrb.cer","If-Modified-Since: yesterday\r\n");
+		check(r.head.compare(0,15,"HTTP/1.1 200 OK") == 0,"a malformed date is ignored");
+
+		check(get("/../jrb.cer","").head.compare(0,12,"HTTP/1.1 400") == 0,"a path with .. is rejected");
+		check(get("/%2e%2e/jrb.cer","").head.compare(0,12,"HTTP/1.1 400") == 0,"an escaped .. is rejected");
+		check(get("/missing.txt","").head.compare(0,12,"HTTP/1.1 404") == 0,"a missing file gets 404");
+
+		r = fetch(19304,"HEAD /jrb.cer HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n");
+		check(r.head.compare(0,15,"HTTP/1.1 200 OK") == 0 && r.has("Content-Length: " + size) && r.body.empty(),"HEAD gets the length without the body");
+	}
+
+	// Accept-Encoding picks the coding by q-value, statuses without a full body are left alone
+	// and a precompressed file.gz goes to the clients that take gzip
+	void test_compression(){
+		std::atomic<int> observed(0);
+		response::set_compression_observer([&observed](const compression_stats&){++observed;});
+		static_file_handler files(".");
+		local_server s(19305);
+		s.server.accept([files](request& req, response& res)mutable->bool{
+			if(req.url().find("/jrb_test_") == 0) return files(req,res);
+			res.compress(req,6,0);
+			res.content_type("text/plain");
+			if(req.url() == "/204") res.status(status_t::no_content);
+			else if(req.url() == "/304") res.status(status_t::not_modified);
+			else if(req.url() == "/206") res.status(status_t::partial_content);
+			if(req.url() != "/204" && req.url() != "/304") res.body(std::string(2000,'a'));
+			return true;
+		});
+		s.run();
+		auto get = [](const std::string& path, const std::string& accept){
+			std::string headers = accept.empty() ? "" : "Accept-Encoding: " + accept + "\r\n";
+			return fetch(19305,"GET " + path + " HTTP/1.1\r\nHost: a\r\nConnection: close\r\n" + headers + "\r\n");
+		};
+
+		raw_response r = get("/","gzip");
+		check(r.has("Content-Encoding: gzip") && r.has("Vary: Accept-Encoding") && r.body.size() < 2000,"gzip is used when accepted");
+		check(observed == 1,"the observer sees a compressed response");
+		check(get("/","gzip;q=0.5, deflate").has("Content-Encoding: deflate"),"the coding with the higher q-value is used");
+		check(get("/","gzip;q=0, deflate").has("Content-Encoding: deflate"),"q=0 rules a coding out");
+		r = get("/","*;q=0");
+		check(r.head.find("Content-Encoding") == std::string::npos && r.has("Vary: Accept-Encoding") && r.body == std::string(2000,'a'),"*;q=0 leaves the body as is, still with Vary");
+		check(get("/","").head.find("Content-Encoding") == std::string::npos,"no Accept-Encoding, no compression");
+		const char* statuses[] = {"/204","/304","/206"};
+		for(auto path:statuses){
+			check(get(path,"gzip").head.find("Content-Encoding") == std::string::npos,"204, 304 and 206 are not compressed");
+		}
+		response::set_compression_observer(nullptr);
+		get("/","gzip");
+		check(observed == 3,"a removed observer is not called");
+
+		// the file first, so the .gz sibling is not older
+		std::ofstream("jrb_test_gz.txt",std::ios::binary) << "plain text";
+		std::ofstream("jrb_test_gz.txt.gz",std::ios::binary) << "gzipped text";
+		r = get("/jrb_test_gz.txt","gzip");
+		check(r.has("Content-Encoding: gzip") && r.has("Vary: Accept-Encoding") && r.body == "gzipped text","the .gz sibling goes to clients that take gzip");
+		r = get("/jrb_test_gz.txt","");
+		check(r.head.find("Content-Encoding") == std::string::npos && r.has("Vary: Accept-Encoding") && r.body == "plain text","the file goes to the others");
+		std::remove("jrb_test_gz.txt");
+		std::remove("jrb_test_gz.txt.gz");
+	}
+
+	// data compressed by zlib with windowBits bits: 15 + 16 for gzip, 15 for zlib, -15 for raw deflate
+	std::string deflated(const std::string& data, int bits){
+		z_stream s = z_stream();
+		deflateInit2(&s,6,Z_DEFLATED,bits,8,Z_DEFAULT_STRATEGY);
+		std::string out(deflateBound(&s,static_cast<uLong>(data.size())),'\0');
+		s.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+		s.avail_in = static_cast<uInt>(data.size());
+		s.next_out = reinterpret_cast<Bytef*>(&out[0]);
+		s.avail_out = static_cast<uInt>(out.size());
+		deflate(&s,Z_FINISH);
+		out.resize(out.size() - s.avail_out);
+		deflateEnd(&s);
+		return out;
+	}
+
+	// gzip, zlib wrapped and raw deflate bodies are decoded, and one that decodes to more than
+	// the limit fails with message_size. Served by hand, one response per connection
+	void test_client_decoding(){
+		std::string text;
+		for(int i = 0; i < 2000; ++i) text += "line " + boost::lexical_cast<std::string>(i) + "\n";
+		struct canned{const char* coding; int bits;};
+		const canned bodies[] = {{"gzip",15 + 16},{"deflate",15},{"deflate",-15},{"gzip",15 + 16}};
+		std::vector<std::string> responses;
+		for(auto& b:bodies){
+			std::string body = deflated(text,b.bits);
+			responses.push_back(std::string("HTTP/1.1 200 OK\r\nContent-Encoding: ") + b.coding + "\r\nContent-Length: "
+				+ boost::lexical_cast<std::string>(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+		}
+		boost::asio::io_service server_io;
+		boost::asio::ip::tcp::acceptor acceptor(server_io,boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"),19306));
+		std::thread server([&]{
+			for(auto& r:responses){
+				boost::asio::ip::tcp::socket socket(server_io);
+				boost::system::error_code ec;
+				acceptor.accept(socket,ec);
+				if(ec) return;
+				std::string request;
+				std::array<char,4096> buffer;
+				while(request.find("\r\n\r\n") == std::string::npos){
+					std::size_t n = socket.read_some(boost::asio::buffer(buffer),ec);
+					if(ec) break;
+					request.append(buffer.data(),n);
+				}
+				boost::asio::write(socket,boost::asio::buffer(r),ec);
+				socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both,ec);
+			}
+		});
+
+		boost::asio::io_service client_io;
+		std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(client_io));
+		std::thread client_thread([&]{client_io.run();});
+		{
+			http_client client(uri("http://127.0.0.1:19306/"),client_io);
+			const char* names[] = {"a gzip body is decoded","a zlib deflate body is decoded","a raw deflate body is decoded"};
+			for(auto name:names){
+				try{
+					client_response r = client.get();
+					check(r.body() == text && r.header("Content-Encoding").size() == 0,name);
+				}
+				catch(std::exception& e){
+					check(false,e.what());
+				}
+			}
+			client.set_max_decoded_body(1000);
+			bool too_large = false;
+			try{
+				client.get();
+			}
+			catch(boost::system::system_error& e){
+				too_large = e.code() == boost::system::errc::message_size;
+			}
+			check(too_large,"a body decoding to more than the limit fails with message_size");
+		}
+		work.reset();
+		client_thread.join();
+		server.join();
+	}
+
+	// A client that sends its headers too slowly is closed and the handler gets timed_out. An idle
+	// keep-alive connection is closed too, which is not an error
+	void test_timeouts(){
+		local_server s(19307);
+		connection_timeouts timeouts = connection_timeouts::none();
+		timeouts.header_read = 300;
+		timeouts.keep_alive_idle = 300;
+		s.server.set_timeouts(timeouts);
+		std::atomic<int> timed_out(0), other_errors(0);
+		s.server.accept_ec([&](request&, response& res, const boost::system::error_code& ec)->bool{
+			if(ec == boost::asio::error::timed_out) ++timed_out;
+			else if(ec) ++other_errors;
+			else res.body("ok");
+			return !ec;
+		});
+		s.run();
+
+		{
+			test_connection c(19307);
+			c.send("GET / HTTP/1.1\r\nHost: a\r\n");
+			std::string out;
+			check(c.read_until_closed(out,2000) && out.empty(),"a request without the end of its headers is closed");
+			check(wait_for([&]{return timed_out == 1;},1000),"the handler gets timed_out for it");
+		}
+		{
+			// a byte every 50ms keeps the connection busy, but not past the header deadline
+			test_connection c(19307);
+			std::string request = "GET / HTTP/1.1\r\nHost: a\r\nX-Slow: " + std::string(40,'a') + "\r\n\r\n";
+			std::string out;
+			std::size_t sent = 0;
+			boost::system::error_code ec;
+			while(sent < request.size() && !c.closed){
+				boost::asio::write(c.socket,boost::asio::buffer(&request[sent],1),ec);
+				if(ec) break;
+				++sent;
+				c.read(out,50);
+			}
+			check(sent < request.size() && out.empty(),"a client trickling its headers is closed before it is done");
+			check(wait_for([&]{return timed_out == 2;},1000),"the handler gets timed_out for the trickling client");
+		}
+		{
+			test_connection c(19307);
+			c.send("GET / HTTP/1.1\r\nHost: a\r\n\r\n");
+			std::string out;
+			check(c.read_until_closed(out,2000) && out.find("ok") != std::string::npos,"an idle keep-alive connection is closed after its response");
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		check(timed_out == 2 && other_errors == 0,"closing an idle connection is not reported as an error");
+	}
+
+	// At the connection limit a new connection gets a 503 with shedding on, and otherwise waits
+	// until a connection goes or the limit is raised
+	void test_connection_limit(){
+		const std::string get = "GET / HTTP/1.1\r\nHost: a\r\n\r\n";
+		auto handler = [](request&, response& res)->bool{
+			res.body("ok");
+			return true;
+		};
+		{
+			local_server s(19308);
+			s.server.set_max_connections(1,true);
+			s.server.accept(handler);
+			s.run();
+			test_connection first(19308);
+			first.send(get);
+			std::string out;
+			check(first.read_until(out,"ok",1,2000),"the first connection is served");
+			test_connection second(19308);
+			std::string shed;
+			check(second.read_until_closed(shed,2000) && shed.find("503 Service Unavailable") != std::string::npos,"a connection over the limit gets 503 and is closed");
+			check(s.server.shed_connections() == 1 && s.server.connections() == 1,"the shed connection is counted and takes no place");
+		}
+		{
+			local_server s(19309);
+			s.server.set_max_connections(1);
+			s.server.accept(handler);
+			s.run();
+			std::unique_ptr<test_connection> first(new test_connection(19309));
+			first->send(get);
+			std::string out;
+			check(first->read_until(out,"ok",1,2000),"the first connection is served");
+
+			test_connection second(19309);
+			second.send(get);
+			std::string waiting;
+			second.read(waiting,300);
+			check(waiting.empty(),"a connection over the limit is not accepted");
+			first.reset();
+			check(second.read_until(waiting,"ok",1,2000),"it is served once the first connection closes");
+
+			test_connection third(19309);
+			third.send(get);
+			std::string raised;
+			third.read(raised,300);
+			check(raised.empty(),"the next one waits again");
+			s.server.set_max_connections(2);
+			check(third.read_until(raised,"ok",1,2000),"raising the limit accepts it");
+		}
+	}
+
+	// Query parameters come sorted by name with duplicates in order, decoded, and without the ones
+	// that have an invalid escape
+	void test_query_params(){
+		local_server s(19310);
+		std::mutex mutex;
+		std::string names, b, c, a, missing;
+		s.server.accept([&](request& req, response& res)->bool{
+			std::lock_guard<std::mutex> lock(mutex);
+			for(auto& p:req.query_params()) names += p.first.to_string() + "=" + p.second.to_string() + ";";
+			b = req.query_param("b").to_string();
+			c = req.query_param("c").to_string();
+			a = req.query_param("a").to_string();
+			missing = req.query_param("missing").to_string();
+			res.body("ok");
+			return true;
+		});
+		s.run();
+		fetch(19310,"GET /p?b=2&a=1&b=3&c=%41+x%2B&bad=%zz&e= HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n");
+		std::lock_guard<std::mutex> lock(mutex);
+		check(names == "a=1;b=2;b=3;c=A x+;e=;","parameters are sorted by name, duplicates keep their order");
+		check(b == "3","query_param gives the last of duplicate names");
+		check(a == "1" && c == "A x+","values are decoded, '+' as a space");
+		check(missing.empty(),"a missing parameter is empty");
+	}
+
+	void test_uri(){
+		uri ipv6("http://[::1]:8080/x");
+		check(ipv6.valid() && ipv6.host() == string_ref("::1") && ipv6.port() == 8080,"an IPv6 host and its port");
+		check(ipv6.origin() == string_ref("http://[::1]:8080") && ipv6.get_uri_string() == "http://[::1]:8080/x","an IPv6 host keeps its brackets in the uri");
+		ipv6.port(81);
+		check(ipv6.valid() && ipv6.port() == 81 && ipv6.get_uri_string() == "http://[::1]:81/x","changing the port of an IPv6 uri");
+
+		uri plain("http://example.com/a/b?x=1&y=2#frag");
+		check(plain.valid() && plain.port() == 0,"no port is port 0");
+		check(plain.host() == string_ref("example.com") && plain.path() == string_ref("/a/b"),"host and path");
+		check(plain.query() == string_ref("x=1&y=2") && plain.fragment() == string_ref("frag"),"query and fragment");
+		check(plain.get_uri_client_request_string() == string_ref("/a/b?x=1&y=2"),"the request target leaves out the fragment");
+		plain.host("::2");
+		check(plain.valid() && plain.origin() == string_ref("http://[::2]"),"an IPv6 host set on its own gets brackets");
+	}
+
+	void test_form_decoding(){
+		std::map<std::string,std::string> m;
+		parse_name_value(std::string("a+b=c+d&sum=1%2B1&x=%2b+%20"),m);
+		check(m["a b"] == "c d","'+' in a form component is a space");
+		check(m["sum"] == "1+1","%2B in a form component stays '+'");
+		check(m["x"] == "+  ","%2b, '+' and %20 in one component");
+	}
+
+#ifdef JRB_NODE_SSL
+	std::atomic<int> tls_handshakes(0);
+	std::atomic<int> tls_resumed(0);
+
+	void count_handshakes(const SSL* ssl, int where, int){
+		if(where & SSL_CB_HANDSHAKE_DONE){
+			++tls_handshakes;
+			if(SSL_session_reused(const_cast<SSL*>(ssl))) ++tls_resumed;
+		}
+	}
+
+	// Runs the GETs one after another against a local https server, returns how many got "ok"
+	int https_gets(int count, bool keep_alive){
+		boost::asio::ssl::context ctx(boost::asio::ssl::context::sslv23_server);
+		ctx.use_certificate_file("jrb.cer",boost::asio::ssl::context_base::file_format::pem);
+		ctx.use_private_key_file("jrb.pkey",boost::asio::ssl::context_base::file_format::pem);
+		// one handshake per accepted connection, resumed or not
+		SSL_CTX_set_info_callback(ctx.native_handle(),&count_handshakes);
+		tls_handshakes = 0;
+		tls_resumed = 0;
+
+		boost::asio::io_service io;
+		https_server server(io,"127.0.0.1",19191,ctx);
+		server.accept([keep_alive](request&, response& res)->bool{
+			if(!keep_alive) res.keep_alive(false);
+			res.body("ok");
+			return true;
+		});
+		std::thread t([&]{io.run();});
+
+		boost::asio::io_service client_io;
+		std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(client_io));
+		std::thread client_thread([&]{client_io.run();});
+		int ok = 0;
+		{
+			http_client client(uri("https://127.0.0.1:19191/"),client_io);
+			for(int i = 0; i < count; ++i){
+				try{
+					if(client.get().body() == "ok") ++ok;
+				}
+				catch(std::exception&){}
+			}
+		}
+		work.reset();
+		client_thread.join();
+		io.stop();
+		t.join();
+		return ok;
+	}
+
+	// Keep-alive https requests from one client must share one pooled connection
+	void test_https_connection_reuse(){
+		check(https_gets(6,true) == 6,"https requests succeed");
+		check(tls_handshakes == 1,"https requests reuse one connection");
+	}
+
+	// A connection the server closes must leave its session resumable for the next one
+	void test_https_session_resumption(){
+		check(https_gets(4,false) == 4,"https requests on closed connections succeed");
+		check(tls_handshakes == 4 && tls_resumed == 3,"later https connections resume the session");
+	}
+#endif
+}
+
+int main()
+{
+	test_uri();
+	test_form_decoding();
+	test_query_params();
+	test_pipelining();
+	test_client_pool_stale_connection();
+	test_chunked_response();
+	test_static_files();
+	test_compression();
+	test_client_decoding();
+	test_timeouts();
+	test_connection_limit();
+#ifdef JRB_NODE_SSL
+	test_https_connection_reuse();
+	test_https_session_resumption();
+#endif
+
+	std::cout << (failures ? "some checks failed" : "all checks passed") << std::endl;
+	return failures;
+}